@@ -18,7 +18,10 @@
 //
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include "shadowmap.hpp"
 
@@ -26,73 +29,554 @@
 namespace Shadowmap {
 
 
+constexpr int SHMAP_BAND = 8;  // shadow map rows per build task
+constexpr int SHMAP_PROBES = 768;  // camera rays estimating light importance, in a grid of the view's aspect
+constexpr int SHMAP_MIN_LEVEL = 4;  // smallest budgeted maps, SHMAP_W and SHMAP_H halved this many times
+
+/**
+ * Write obj's geometry into the scene's buffers, starting at its vertex
+ * and triangle offsets in built. Objects are placed in world space with
+ * their index in Scene.objs; meshes for instances, with index -1, stay
+ * in mesh space.
+ */
+void place_mesh(Scene& scene, const Mesh& obj, int index, const BuiltMesh& built) {
+    Vec3 loc = index < 0 ? Vec3() : obj.loc;
+    for (int i = 0; i < built.vert_count; i++)
+        scene._verts[built.first_vert + i] = obj.verts[i].add(loc);
+
+    for (int i = 0; i < built.count; i++) {
+        const Tri& tri = obj.tris[i];
+        Tri& copy = scene._tris[built.first + i];
+        for (int j = 0; j < 3; j++)
+            copy.v[j] = tri.v[j] + built.first_vert;
+        scene._normals[built.first + i] = obj.normals[i];
+        scene._tri_objs[built.first + i] = index;
+    }
+
+    if (index >= 0)
+        scene._colors[index] = obj.color;
+}
+
+/**
+ * Record the state of obj as preprocessed, for rebuild().
+ */
+BuiltMesh record_mesh(Mesh& obj, int first_vert, int first) {
+    obj.dirty = false;
+
+    BuiltMesh built;
+    built.loc = obj.loc;
+    built.color = obj.color;
+    built.verts = obj.verts.data();
+    built.tris = obj.tris.data();
+    built.vert_count = obj.verts.size();
+    built.count = obj.tris.size();
+    built.first_vert = first_vert;
+    built.first = first;
+    return built;
+}
+
 /**
  * Preprocess the scene.
- * * Face._radius
+ * Replaces the scene's geometry buffers with all objects in world space.
  */
 void preprocess(Scene& scene) {
+    scene._built_objs.clear();
+    scene._built_meshes.clear();
+
+    int verts = 0, tris = 0;
     for (Mesh& obj: scene.objs) {
-        for (Face& face: obj.faces) {
-            Face copy = face;
+        scene._built_objs.push_back(record_mesh(obj, verts, tris));
+        verts += obj.verts.size();
+        tris += obj.tris.size();
+    }
+    for (Mesh& mesh: scene.meshes) {
+        scene._built_meshes.push_back(record_mesh(mesh, verts, tris));
+        verts += mesh.verts.size();
+        tris += mesh.tris.size();
+    }
 
-            copy._color = obj.color;
+    scene._verts.resize(verts);
+    scene._tris.resize(tris);
+    scene._normals.resize(tris);
+    scene._tri_objs.resize(tris);
+    scene._colors.resize(scene.objs.size());
+    for (int i = 0; i < (int)scene.objs.size(); i++)
+        place_mesh(scene, scene.objs[i], i, scene._built_objs[i]);
+    for (int i = 0; i < (int)scene.meshes.size(); i++)
+        place_mesh(scene, scene.meshes[i], -1, scene._built_meshes[i]);
+}
 
-            copy.p1 = copy.p1.add(obj.loc);
-            copy.p2 = copy.p2.add(obj.loc);
-            copy.p3 = copy.p3.add(obj.loc);
 
-            copy._center = copy.p1.add(copy.p2).add(copy.p3).div(3);
-            copy._radius = max(
-                distance(copy.p1, copy._center),
-                distance(copy.p2, copy._center),
-                distance(copy.p3, copy._center)
-            );
+/**
+ * Bounding sphere (center, radius) of vertices [first, first+count) of Scene._verts.
+ */
+std::pair<Vec3, double> bound_verts(const Scene& scene, int first, int count) {
+    Vec3 lo(1e18, 1e18, 1e18), hi(-1e18, -1e18, -1e18);
+    for (int i = first; i < first+count; i++) {
+        const Vec3& p = scene._verts[i];
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    if (count == 0)
+        return {Vec3(), 0};
+
+    Vec3 center = lo.add(hi).div(2);
+    return {center, distance(lo, hi) / 2 + 1e-6};
+}
 
-            scene._faces.push_back(copy);
+/**
+ * Cones seen from light around bounding spheres (center, radius).
+ */
+std::vector<Cone> make_cones(const std::vector<std::pair<Vec3, double>>& spheres, const Light& light) {
+    std::vector<Cone> cones;
+    for (const auto& sphere: spheres) {
+        Vec3 delta = sphere.first.sub(light.loc);
+        double d = delta.magnitude();
+
+        Cone cone;
+        if (d <= sphere.second) {
+            cone.axis = Vec3(0, 0, 1);
+            cone.cos_half = -1;
+        } else {
+            cone.axis = delta.div(d);
+            cone.cos_half = sqrt(1 - pow(sphere.second / d, 2));
         }
+        cones.push_back(cone);
     }
+    return cones;
 }
 
 
 /**
- * Builds a shadow map for light and stores in map.
- * @param index is for verbose
+ * Builds rows [y0, y1) of the shadow map for light and stores in map.
+ * Only reads the scene, so bands of one or more maps can be built concurrently.
+ * @param cones if not null, only texels inside these are retraced
  */
-void build_map(Scene& scene, ShadowMap& map, Light& light, int index = 0, bool verbose = false) {
-    build_faces(scene, light.loc);
+void build_map(const Scene& scene, ShadowMap& map, const Light& light, int y0, int y1,
+        const std::vector<Cone>* cones = nullptr) {
+    if (map.layout == SHMAP_CUBE) {
+        // face coordinate of each texel column/row, the same on every face
+        std::vector<double> coord(map.h);
+        for (int i = 0; i < map.h; i++)
+            coord[i] = map.direction(i, 0).y;
 
-    int last_percent = -1;
-    for (int y = 0; y < scene.SHMAP_H; y++) {
-        for (int x = 0; x < scene.SHMAP_W; x++) {
-            if (verbose) {
-                int percent = (y*scene.SHMAP_W + x) * 100 / (scene.SHMAP_H*scene.SHMAP_W);
-                if (percent != last_percent) {
-                    std::cerr << "\rShadow map " << index << ": " << percent << "%" << std::flush;
-                    last_percent = percent;
-                }
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < map.w; x++) {
+                int face = x / map.h;
+                double c[3];
+                c[face/2] = face % 2 ? -1 : 1;
+                c[(face/2 + 1) % 3] = coord[x % map.h];
+                c[(face/2 + 2) % 3] = coord[y];
+
+                Ray ray(light.loc, Vec3(c[0], c[1], c[2]));
+                if (cones == nullptr || in_cones(*cones, ray.dir))
+                    map.set(x, y, intersect(scene, ray).dist);
             }
+        }
+        return;
+    }
+
+    // sin and cos of pan per column, so there is no trig per texel
+    std::vector<double> pan_sin(map.w), pan_cos(map.w);
+    for (int x = 0; x < map.w; x++) {
+        double pan = ((double)x/map.w - 0.5) * PI * 2;
+        pan_sin[x] = sin(pan);
+        pan_cos[x] = cos(pan);
+    }
 
-            double tilt = ((double)y/scene.SHMAP_H - 0.5) * PI;
-            double pan = ((double)x/scene.SHMAP_W - 0.5) * PI * 2;
+    for (int y = y0; y < y1; y++) {
+        double tilt = ((double)y/map.h - 0.5) * PI;
+        double tilt_sin = sin(tilt), tilt_cos = cos(tilt);
 
-            Vec3 delta(sin(pan)*cos(tilt), cos(pan)*cos(tilt), -sin(tilt));
+        for (int x = 0; x < map.w; x++) {
+            Vec3 delta(pan_sin[x]*tilt_cos, pan_cos[x]*tilt_cos, -tilt_sin);
             Ray ray(light.loc, delta);
-            double dist = intersect(scene._faces, ray).dist;
+            if (cones == nullptr || in_cones(*cones, ray.dir))
+                map.set(x, y, intersect(scene, ray).dist);
+        }
+    }
+}
+
+
+/**
+ * Distance from light to the farthest corner of the scene's bounds.
+ */
+double max_depth(const Scene& scene, const Light& light) {
+    Vec3 bmin, bmax;
+    if (!scene_bounds(scene, bmin, bmax))
+        return 1e4;
 
-            map.set(x, y, dist);
+    double dx = std::max(std::abs(bmin.x - light.loc.x), std::abs(bmax.x - light.loc.x));
+    double dy = std::max(std::abs(bmin.y - light.loc.y), std::abs(bmax.y - light.loc.y));
+    double dz = std::max(std::abs(bmin.z - light.loc.z), std::abs(bmax.z - light.loc.z));
+    return distance(dx, dy, dz) + 1e-3;
+}
+
+/**
+ * Size of a shadow map at level, halving SHMAP_W and SHMAP_H per level.
+ */
+void map_size(const Scene& scene, int level, int& w, int& h) {
+    w = std::max(scene.SHMAP_W >> level, 1);
+    h = std::max(scene.SHMAP_H >> level, 1);
+    if (scene.SHMAP_LAYOUT == SHMAP_CUBE) {
+        h = std::max((int)sqrt(w * h / 6.0), 1);
+        w = 6 * h;
+    }
+}
+
+/**
+ * Allocates an empty shadow map for light with the scene's layout and
+ * storage, at level. The depth range reaches the far corner of the
+ * scene's bounding box; build_maps() fits its near end.
+ */
+ShadowMap create_map(const Scene& scene, const Light& light, int level) {
+    int w, h;
+    map_size(scene, level, w, h);
+    ShadowMap map(w, h, scene.SHMAP_LAYOUT, scene.SHMAP_PRECISION, scene.SHMAP_TILED);
+    map.depth_max = max_depth(scene, light);
+    return map;
+}
+
+/**
+ * Share of each light in what the camera sees: at a grid of camera rays
+ * over the view of Scene.cam_aspect, the sum of each light's unshadowed
+ * contribution to the hit. Needs the scene compiled.
+ */
+std::vector<double> light_importance(const Scene& scene) {
+    std::vector<double> importance(scene.lights.size(), 0);
+    double aspect = scene.cam_aspect > 0 ? scene.cam_aspect : 0.75;
+    double fov_x = scene.fov / 360, fov_y = fov_x * aspect;
+    int probe_w = std::max((int)std::lround(std::sqrt(SHMAP_PROBES / aspect)), 1);
+    int probe_h = std::max((int)std::lround(probe_w * aspect), 1);
+    for (int j = 0; j < probe_h; j++) {
+        for (int i = 0; i < probe_w; i++) {
+            double tilt = ((j+0.5) / probe_h - 0.5) * 2*PI * fov_y + scene.cam_tilt;
+            double pan = ((i+0.5) / probe_w - 0.5) * 2*PI * fov_x + scene.cam_pan;
+            Vec3 dir(sin(pan)*cos(tilt), cos(pan)*cos(tilt), -sin(tilt));
+            Intersect hit = intersect(scene, Ray(scene.cam_loc, dir));
+            if (hit.dist >= 1e9-10)
+                continue;
+
+            // as shade_packet() does, without shadows
+            for (int k = 0; k < (int)scene.lights.size(); k++) {
+                const Light& light = scene.lights[k];
+                Vec3 delta = light.loc.sub(hit.pos);
+                double d = delta.magnitude();
+                double fac_norm = std::max(delta.dot(hit.normal) / d, 0.0);
+                importance[k] += std::min(light.power * fac_norm / (d*d) * light.color.mul(hit.color).sum() / 3, 1.0);
+            }
+        }
+    }
+    return importance;
+}
+
+/**
+ * Bytes per texel of a map stored with precision, as ShadowMap::bytes().
+ */
+size_t precision_bytes(ShadowPrecision precision) {
+    switch (precision) {
+        case SHMAP_FLOAT: return sizeof(float);
+        case SHMAP_U16: return sizeof(uint16_t);
+        default: return sizeof(double);
+    }
+}
+
+/**
+ * Level of each light's shadow map. With SHMAP_BUDGET set, every map
+ * starts at SHMAP_MIN_LEVEL and the map with the most importance per texel
+ * is doubled while the budget allows, so texels end up about proportional
+ * to importance. If the maps don't fit at SHMAP_MIN_LEVEL, the one with
+ * the least importance per texel is halved instead until they do, and an
+ * overrun left with every map at its smallest is reported if verbose.
+ * Otherwise all are 0.
+ */
+std::vector<int> map_levels(const Scene& scene, bool verbose) {
+    int lights = scene.lights.size();
+    std::vector<int> levels(lights, 0);
+    if (scene.SHMAP_BUDGET == 0 || lights == 0)
+        return levels;
+
+    size_t texel_bytes = precision_bytes(scene.SHMAP_PRECISION)
+        + (scene.SHMAP_FILTER == SHMAP_VSM ? 2 * sizeof(double) : 0);
+    auto bytes = [&](int level) {
+        int w, h;
+        map_size(scene, level, w, h);
+        return (size_t)w * h * texel_bytes;
+    };
+
+    std::vector<double> importance = light_importance(scene);
+    size_t used = 0;
+    for (int i = 0; i < lights; i++) {
+        levels[i] = SHMAP_MIN_LEVEL;
+        used += bytes(levels[i]);
+    }
+
+    while (used > scene.SHMAP_BUDGET) {
+        int worst = -1;
+        double worst_ratio = 1e300;
+        for (int i = 0; i < lights; i++) {
+            double ratio = importance[i] / bytes(levels[i]);
+            if (bytes(levels[i] + 1) < bytes(levels[i]) && ratio < worst_ratio) {
+                worst = i;
+                worst_ratio = ratio;
+            }
+        }
+        if (worst < 0) {
+            if (verbose)
+                std::cerr << "Shadow maps need " << used << " bytes at their smallest, over SHMAP_BUDGET "
+                    << scene.SHMAP_BUDGET << std::endl;
+            break;
         }
+        used -= bytes(levels[worst]) - bytes(levels[worst] + 1);
+        levels[worst]++;
     }
+
+    std::vector<bool> done(lights, false);
+    while (true) {
+        int best = -1;
+        double best_ratio = -1;
+        for (int i = 0; i < lights; i++) {
+            double ratio = importance[i] / bytes(levels[i]);
+            if (!done[i] && levels[i] > 0 && ratio > best_ratio) {
+                best = i;
+                best_ratio = ratio;
+            }
+        }
+        if (best < 0)
+            break;
+
+        size_t grow = bytes(levels[best] - 1) - bytes(levels[best]);
+        if (used + grow > scene.SHMAP_BUDGET) {
+            done[best] = true;
+            continue;
+        }
+        levels[best]--;
+        used += grow;
+    }
+    return levels;
+}
+
+/**
+ * True if map no longer matches the scene's settings, or can't store
+ * the depths of the scene's bounds.
+ */
+bool map_outdated(const Scene& scene, const ShadowMap& map, const Light& light, int level) {
+    int w, h;
+    map_size(scene, level, w, h);
+    return map.w != w || map.h != h || map.layout != scene.SHMAP_LAYOUT
+        || map.precision != scene.SHMAP_PRECISION || map.tiled != scene.SHMAP_TILED
+        || (map.precision == SHMAP_U16 && max_depth(scene, light) > map.depth_max);
+}
+
+/**
+ * Traces the maps of lights in todo on the thread pool.
+ * @param cones per light, null to build whole maps
+ */
+void trace_maps(Scene& scene, const std::vector<int>& todo, const std::vector<std::vector<Cone>>* cones,
+        bool verbose) {
+    // one task per band of rows of every map, all in one pool run
+    std::vector<int> bands, first_task;
+    int tasks = 0;
+    for (int i: todo) {
+        first_task.push_back(tasks);
+        bands.push_back((scene.shadow_maps[i].h + SHMAP_BAND - 1) / SHMAP_BAND);
+        tasks += bands.back();
+    }
+
+    std::atomic<int> done(0);
+    std::mutex print_lock;
+    int last_percent = -1;  // for verbose
+    std::vector<double> task_ms(tasks);
+
+    thread_pool().run(tasks, [&](int task, int worker) {
+        int j = std::upper_bound(first_task.begin(), first_task.end(), task) - first_task.begin() - 1;
+        int i = todo[j];
+        ShadowMap& map = scene.shadow_maps[i];
+        int y0 = (task - first_task[j]) * SHMAP_BAND;
+        int y1 = std::min(y0 + SHMAP_BAND, map.h);
+        double start = time_ms();
+        build_map(scene, map, scene.lights[i], y0, y1, cones ? &(*cones)[j] : nullptr);
+        task_ms[task] = time_ms() - start;
+
+        if (verbose) {
+            int percent = ++done * 100 / tasks;
+            std::lock_guard<std::mutex> lock(print_lock);
+            if (percent > last_percent) {
+                std::cerr << "\rShadow maps: " << percent << "%" << std::flush;
+                last_percent = percent;
+            }
+        }
+    }, scene.threads);
+
+    // each map's bands summed, so the time of building it on one thread
+    for (int j = 0; j < (int)todo.size(); j++) {
+        double ms = 0;
+        for (int t = first_task[j]; t < first_task[j] + bands[j]; t++)
+            ms += task_ms[t];
+        record_phase_ms(cones ? "partial_shadow_map" : "shadow_map", todo[j], ms);
+    }
+}
+
+/**
+ * Stores the depths built into staged, NaN where not rebuilt, in the
+ * SHMAP_U16 map. depth_min is fitted to the nearest depth of a whole
+ * build, and lowered, requantizing the texels kept, for a partial one
+ * that finds a nearer depth.
+ */
+void store_u16(ShadowMap& map, const ShadowMap& staged, bool whole) {
+    double near = 1e300;
+    for (int y = 0; y < map.h; y++) {
+        for (int x = 0; x < map.w; x++) {
+            double d = staged.get(x, y);
+            if (d < map.depth_max)
+                near = std::min(near, d);
+        }
+    }
+
+    ShadowMap old = map;  // same data, the range it was stored with
+    if (whole)
+        map.depth_min = near < 1e300 ? near : 0;
+    else if (near < map.depth_min)
+        map.depth_min = near;
+    bool requantize = !whole && map.depth_min != old.depth_min;
+
+    for (int y = 0; y < map.h; y++) {
+        for (int x = 0; x < map.w; x++) {
+            double d = staged.get(x, y);
+            if (!std::isnan(d))
+                map.set(x, y, d);
+            else if (requantize)
+                map.set(x, y, old.get(x, y));
+        }
+    }
+}
+
+/**
+ * Builds the maps of lights in todo with the scene's builder. SHMAP_U16
+ * maps are built at float precision first, so their depth range can be
+ * fitted to what was found, see store_u16().
+ * @param cones per light, null to build whole maps
+ */
+void build_maps(Scene& scene, const std::vector<int>& todo, const std::vector<std::vector<Cone>>* cones,
+        bool verbose) {
+    std::vector<std::pair<int, ShadowMap>> u16;  // light, its map while the staged one is built
+    for (int i: todo) {
+        ShadowMap& map = scene.shadow_maps[i];
+        if (map.precision != SHMAP_U16)
+            continue;
+        ShadowMap staged(map.w, map.h, map.layout, SHMAP_FLOAT, map.tiled);
+        std::fill_n((float*)staged.data, staged.bytes() / sizeof(float), NAN);
+        u16.push_back({i, map});
+        map = staged;
+    }
+
+    if (scene.SHMAP_BUILDER == SHMAP_RASTER)
+        raster_maps(scene, todo, cones, verbose);
+    else
+        trace_maps(scene, todo, cones, verbose);
+
+    for (std::pair<int, ShadowMap>& entry: u16) {
+        ShadowMap& staged = scene.shadow_maps[entry.first];
+        store_u16(entry.second, staged, cones == nullptr);
+        staged.free();
+        staged = entry.second;
+    }
+}
+
+/**
+ * Prefilters the maps of lights in todo, and any others without moments,
+ * if SHMAP_FILTER is SHMAP_VSM. Otherwise frees all maps' moments.
+ */
+void prefilter_maps(Scene& scene, const std::vector<int>& todo) {
+    std::vector<int> maps;
+    for (int i = 0; i < (int)scene.shadow_maps.size(); i++) {
+        ShadowMap& map = scene.shadow_maps[i];
+        if (scene.SHMAP_FILTER != SHMAP_VSM) {
+            delete[] map._moments;
+            map._moments = nullptr;
+        } else if (map._moments == nullptr || std::find(todo.begin(), todo.end(), i) != todo.end()) {
+            maps.push_back(i);
+        }
+    }
+
+    thread_pool().run(maps.size(), [&](int task, int worker) {
+        double start = time_ms();
+        scene.shadow_maps[maps[task]].prefilter();
+        record_phase("prefilter", maps[task], start);
+    }, scene.threads);
+}
+
+/**
+ * Preprocess the scene and build its trees, timing each step.
+ */
+void compile(Scene& scene) {
+    double start = time_ms();
+    preprocess(scene);
+    record_phase("preprocess", -1, start);
+
+    start = time_ms();
+    build_bvh(scene);
+    record_phase("bvh", -1, start);
+
+    start = time_ms();
+    build_instances(scene);
+    record_phase("instances", -1, start);
+}
+
+/**
+ * Record light locations as built, for rebuild().
+ */
+void record_lights(Scene& scene) {
+    scene._built_lights.clear();
+    for (Light& light: scene.lights)
+        scene._built_lights.push_back(light.loc);
 }
 
 
 void build(Scene& scene, bool verbose) {
     int start = time();
 
-    preprocess(scene);
+    if (!scene._compiled)
+        compile(scene);
+
+    for (ShadowMap& map: scene.shadow_maps)
+        map.free();
+    scene.shadow_maps.clear();
 
-    for (int i = 0; i < (int)scene.lights.size(); i++) {
-        scene.shadow_maps.push_back(ShadowMap(scene.SHMAP_W, scene.SHMAP_H));
-        build_map(scene, scene.shadow_maps[i], scene.lights[i], i, verbose);
+    int lights = scene.lights.size();
+    std::vector<int> levels = map_levels(scene, verbose);
+    for (int i = 0; i < lights; i++)
+        scene.shadow_maps.push_back(create_map(scene, scene.lights[i], levels[i]));
+
+    // maps not found in the cache
+    std::vector<int> todo;
+    std::vector<std::string> paths(lights);
+    std::vector<uint64_t> keys(lights);
+    uint64_t faces_hash = scene.SHMAP_CACHE.empty() ? 0 : hash_faces(scene);
+    for (int i = 0; i < lights; i++) {
+        if (!scene.SHMAP_CACHE.empty()) {
+            keys[i] = shadow_map_key(faces_hash, scene.lights[i], scene.shadow_maps[i]);
+            char name[32];
+            snprintf(name, sizeof(name), "/%016llx.shmap", (unsigned long long)keys[i]);
+            paths[i] = scene.SHMAP_CACHE + name;
+
+            if (load_shadow_map(paths[i], keys[i], scene.shadow_maps[i])) {
+                if (verbose)
+                    std::cerr << "Shadow map " << i << " loaded from " << paths[i] << std::endl;
+                continue;
+            }
+        }
+        todo.push_back(i);
+    }
+
+    build_maps(scene, todo, nullptr, verbose);
+    prefilter_maps(scene, todo);
+    record_lights(scene);
+    build_lights(scene);
+
+    if (!scene.SHMAP_CACHE.empty()) {
+        for (int i: todo)
+            save_shadow_map(paths[i], keys[i], scene.shadow_maps[i]);
     }
 
     if (verbose) {
@@ -101,5 +585,135 @@ void build(Scene& scene, bool verbose) {
     }
 }
 
+void rebuild(Scene& scene, bool verbose) {
+    if (scene._built_objs.empty() && scene._built_meshes.empty() && !scene._compiled) {
+        build(scene, verbose);
+        return;
+    }
+
+    int start = time();
+
+    // bounding spheres of geometry before and after it changed
+    std::vector<std::pair<Vec3, double>> changed;
+    bool all_changed = false;
+
+    if (!scene._compiled) {
+        // any change to meshes also rebuilds, as they are shared by instances
+        bool topology = scene.objs.size() != scene._built_objs.size()
+            || scene.meshes.size() != scene._built_meshes.size();
+        for (int i = 0; !topology && i < (int)scene.objs.size(); i++)
+            topology = (int)scene.objs[i].tris.size() != scene._built_objs[i].count
+                || (int)scene.objs[i].verts.size() != scene._built_objs[i].vert_count;
+        for (int i = 0; !topology && i < (int)scene.meshes.size(); i++) {
+            const Mesh& mesh = scene.meshes[i];
+            const BuiltMesh& built = scene._built_meshes[i];
+            topology = mesh.dirty || mesh.verts.data() != built.verts || mesh.tris.data() != built.tris
+                || (int)mesh.tris.size() != built.count || (int)mesh.verts.size() != built.vert_count;
+        }
+
+        if (topology) {
+            compile(scene);
+            all_changed = true;
+        } else {
+            bool moved = false;
+            for (int i = 0; i < (int)scene.objs.size(); i++) {
+                Mesh& obj = scene.objs[i];
+                BuiltMesh& built = scene._built_objs[i];
+                bool geometry = obj.dirty || obj.verts.data() != built.verts || obj.tris.data() != built.tris
+                    || obj.loc.sub(built.loc).sqsum() != 0;
+                if (!geometry && obj.color.sub(built.color).sqsum() == 0)
+                    continue;
+
+                if (geometry)
+                    changed.push_back(bound_verts(scene, built.first_vert, built.vert_count));
+                built = record_mesh(obj, built.first_vert, built.first);
+                place_mesh(scene, obj, i, built);
+                if (geometry)
+                    changed.push_back(bound_verts(scene, built.first_vert, built.vert_count));
+
+                moved = moved || geometry;
+            }
+            if (moved) {
+                double refit_start = time_ms();
+                refit_bvh(scene);
+                record_phase("refit", -1, refit_start);
+            }
+
+            // the instance tree is rebuilt whole, it is small
+            const std::vector<Instance>& old = scene._built_instances;
+            bool instances = false;
+            for (int i = 0; i < (int)std::max(old.size(), scene.instances.size()); i++) {
+                const Instance* a = i < (int)old.size() ? &old[i] : nullptr;
+                const Instance* b = i < (int)scene.instances.size() ? &scene.instances[i] : nullptr;
+                bool placed = a && b && a->mesh == b->mesh && a->loc.sub(b->loc).sqsum() == 0
+                    && memcmp(a->matrix, b->matrix, sizeof(a->matrix)) == 0;
+                if (placed && a->color.sub(b->color).sqsum() == 0)
+                    continue;
+
+                instances = true;
+                if (placed)
+                    continue;
+                for (const Instance* inst: {a, b}) {
+                    Vec3 bmin, bmax;
+                    if (inst && instance_bounds(scene, *inst, bmin, bmax))
+                        changed.push_back({bmin.add(bmax).div(2), distance(bmin, bmax) / 2 + 1e-6});
+                }
+            }
+            if (instances) {
+                double inst_start = time_ms();
+                build_instances(scene);
+                record_phase("instances", -1, inst_start);
+            }
+        }
+    }
+
+    // lights that moved or were added get whole new maps
+    int lights = scene.lights.size();
+    while ((int)scene.shadow_maps.size() > lights) {
+        scene.shadow_maps.back().free();
+        scene.shadow_maps.pop_back();
+    }
+
+    std::vector<int> levels = map_levels(scene, verbose);
+    std::vector<int> full, partial;
+    std::vector<std::vector<Cone>> cones;
+    for (int i = 0; i < lights; i++) {
+        Light& light = scene.lights[i];
+        if (i >= (int)scene.shadow_maps.size()) {
+            scene.shadow_maps.push_back(create_map(scene, light, levels[i]));
+            full.push_back(i);
+        } else if (light.loc.sub(scene._built_lights[i]).sqsum() != 0
+                || map_outdated(scene, scene.shadow_maps[i], light, levels[i])) {
+            scene.shadow_maps[i].free();
+            scene.shadow_maps[i] = create_map(scene, light, levels[i]);
+            full.push_back(i);
+        } else if (all_changed) {
+            full.push_back(i);
+        } else if (!changed.empty()) {
+            partial.push_back(i);
+            cones.push_back(make_cones(changed, light));
+        }
+    }
+
+    // maps loaded from cache are mapped read only
+    for (std::vector<int>* todo: {&full, &partial}) {
+        for (int i: *todo)
+            scene.shadow_maps[i].own();
+    }
+
+    build_maps(scene, full, nullptr, verbose);
+    build_maps(scene, partial, &cones, verbose);
+    prefilter_maps(scene, full);
+    prefilter_maps(scene, partial);
+    record_lights(scene);
+    build_lights(scene);
+
+    if (verbose) {
+        double elapse = (time() - start) / 1000.0;
+        std::cerr << "\rRebuild finished in " << elapse << " seconds, "
+            << full.size() << " full and " << partial.size() << " partial shadow maps" << std::endl;
+    }
+}
+
 
 }  // namespace Shadowmap
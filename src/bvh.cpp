@@ -0,0 +1,709 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+constexpr int BVH_BINS = 16;
+constexpr int BVH_LEAF_SIZE = 4;  // leaves with at most this many faces are not split
+
+
+/**
+ * Number of TriBlock needed for count faces.
+ */
+inline int block_count(int count) {
+    return (count + 3) / 4;
+}
+
+
+/**
+ * Axis aligned bounding box used while building.
+ */
+struct AABB {
+    Vec3 bmin, bmax;
+
+    AABB() {
+        bmin = Vec3(1e300, 1e300, 1e300);
+        bmax = Vec3(-1e300, -1e300, -1e300);
+    }
+
+    void grow(const Vec3& p) {
+        bmin = Vec3(std::min(bmin.x, p.x), std::min(bmin.y, p.y), std::min(bmin.z, p.z));
+        bmax = Vec3(std::max(bmax.x, p.x), std::max(bmax.y, p.y), std::max(bmax.z, p.z));
+    }
+
+    void grow(const AABB& b) {
+        if (b.bmin.x > b.bmax.x)  // empty, e.g. an unused bin
+            return;
+        grow(b.bmin);
+        grow(b.bmax);
+    }
+
+    double area() const {
+        Vec3 d = bmax.sub(bmin);
+        if (d.x < 0)
+            return 0;
+        return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+double axis(const Vec3& v, int a) {
+    return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+
+/**
+ * Store triangle index of Scene._tris in lane of block.
+ */
+void set_lane(const Scene& scene, TriBlock& block, int lane, int index) {
+    const Tri& tri = scene._tris[index];
+    const Vec3& p1 = scene._verts[tri.v[0]];
+    Vec3 e1 = scene._verts[tri.v[1]].sub(p1), e2 = scene._verts[tri.v[2]].sub(p1);
+    block.p1[0][lane] = p1.x;  block.p1[1][lane] = p1.y;  block.p1[2][lane] = p1.z;
+    block.e1[0][lane] = e1.x;  block.e1[1][lane] = e1.y;  block.e1[2][lane] = e1.z;
+    block.e2[0][lane] = e2.x;  block.e2[1][lane] = e2.y;  block.e2[2][lane] = e2.z;
+    block.face[lane] = index;
+}
+
+
+/**
+ * Recursively build nodes for indices [begin, end), depth below the root.
+ * Splits along the axis and bin boundary with the lowest SAH cost, down
+ * to BVH_MAX_DEPTH so traversal stacks of BVH_STACK suffice.
+ */
+void build_node(BVH& bvh, const std::vector<AABB>& boxes, const std::vector<Vec3>& centers,
+        int begin, int end, int depth) {
+    int index = bvh.nodes.size();
+    bvh.nodes.push_back(BVHNode());
+
+    AABB bounds, cbounds;
+    for (int i = begin; i < end; i++) {
+        bounds.grow(boxes[bvh.indices[i]]);
+        cbounds.grow(centers[bvh.indices[i]]);
+    }
+    bvh.nodes[index].bmin = bounds.bmin;
+    bvh.nodes[index].bmax = bounds.bmax;
+
+    int count = end - begin;
+    double leaf_cost = block_count(count);
+    double best_cost = 1e300;
+    int best_axis = -1, best_split = 0;
+
+    if (count > BVH_LEAF_SIZE && depth < BVH_MAX_DEPTH) {
+        for (int a = 0; a < 3; a++) {
+            double lo = axis(cbounds.bmin, a), hi = axis(cbounds.bmax, a);
+            if (hi - lo < 1e-12)
+                continue;
+            double scale = BVH_BINS / (hi - lo);
+
+            AABB bins[BVH_BINS];
+            int counts[BVH_BINS] = {0};
+            for (int i = begin; i < end; i++) {
+                int b = std::min((int)((axis(centers[bvh.indices[i]], a) - lo) * scale), BVH_BINS-1);
+                bins[b].grow(boxes[bvh.indices[i]]);
+                counts[b]++;
+            }
+
+            // sweep from the right to get areas of right halves
+            double right_area[BVH_BINS];
+            int right_count[BVH_BINS];
+            AABB acc;
+            int n = 0;
+            for (int b = BVH_BINS-1; b > 0; b--) {
+                acc.grow(bins[b]);
+                n += counts[b];
+                right_area[b] = acc.area();
+                right_count[b] = n;
+            }
+
+            acc = AABB();
+            n = 0;
+            for (int b = 0; b < BVH_BINS-1; b++) {
+                acc.grow(bins[b]);
+                n += counts[b];
+                double cost = 1 + (acc.area()*block_count(n) + right_area[b+1]*block_count(right_count[b+1])) / bounds.area();
+                if (n > 0 && right_count[b+1] > 0 && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_split = b + 1;
+                }
+            }
+        }
+    }
+
+    if (best_axis == -1 || best_cost >= leaf_cost) {
+        bvh.nodes[index].first = begin;
+        bvh.nodes[index].count = count;
+        return;
+    }
+
+    double lo = axis(cbounds.bmin, best_axis), hi = axis(cbounds.bmax, best_axis);
+    double scale = BVH_BINS / (hi - lo);
+    int* mid = std::partition(bvh.indices.data()+begin, bvh.indices.data()+end, [&](int i) {
+        int b = std::min((int)((axis(centers[i], best_axis) - lo) * scale), BVH_BINS-1);
+        return b < best_split;
+    });
+
+    build_node(bvh, boxes, centers, begin, mid - bvh.indices.data(), depth+1);
+    bvh.nodes[index].first = bvh.nodes.size();
+    bvh.nodes[index].count = 0;
+    build_node(bvh, boxes, centers, mid - bvh.indices.data(), end, depth+1);
+}
+
+/**
+ * Append a tree over items, whose boxes are given in the same order, to
+ * bvh. Leaves are ranges of bvh.indices holding items. Returns the root.
+ */
+int build_tree(BVH& bvh, const std::vector<AABB>& boxes, const std::vector<int>& items) {
+    int n = items.size();
+    std::vector<Vec3> centers(n);
+    for (int i = 0; i < n; i++)
+        centers[i] = boxes[i].bmin.add(boxes[i].bmax).div(2);
+
+    int root = bvh.nodes.size();
+    int base = bvh.indices.size();
+    bvh.nodes.reserve(root + 2*n);
+    bvh.indices.resize(base + n);
+    for (int i = 0; i < n; i++)
+        bvh.indices[base + i] = i;
+
+    build_node(bvh, boxes, centers, base, base + n, 0);
+    for (int i = base; i < base + n; i++)
+        bvh.indices[i] = items[bvh.indices[i]];
+    return root;
+}
+
+/**
+ * Append a tree over triangles [first, first+count) of Scene._tris to
+ * bvh, with leaf faces packed into blocks. Returns the root, or -1 if
+ * there are no triangles.
+ */
+int build_tri_tree(const Scene& scene, BVH& bvh, int first, int count) {
+    if (count == 0)
+        return -1;
+
+    std::vector<AABB> boxes(count);
+    std::vector<int> items(count);
+    for (int i = 0; i < count; i++) {
+        for (int v: scene._tris[first + i].v)
+            boxes[i].grow(scene._verts[v]);
+        items[i] = first + i;
+    }
+    int root = build_tree(bvh, boxes, items);
+
+    // pack leaf faces into blocks, leaves then point at their first block
+    for (int j = root; j < (int)bvh.nodes.size(); j++) {
+        BVHNode& node = bvh.nodes[j];
+        if (node.count == 0)
+            continue;
+
+        int begin = node.first;
+        node.first = bvh.blocks.size();
+        for (int i = 0; i < node.count; i += 4) {
+            TriBlock block = {};
+            for (int lane = 0; lane < 4; lane++) {
+                block.face[lane] = -1;
+                if (i + lane >= node.count)
+                    continue;
+
+                int index = bvh.indices[begin + i + lane];
+                set_lane(scene, block, lane, index);
+            }
+            bvh.blocks.push_back(block);
+        }
+    }
+    return root;
+}
+
+/**
+ * Empty bvh.
+ */
+void clear_bvh(BVH& bvh) {
+    bvh.nodes.clear();
+    bvh.indices.clear();
+    bvh.blocks.clear();
+}
+
+void build_bvh(Scene& scene) {
+    int objs_tris = 0;
+    for (const BuiltMesh& built: scene._built_objs)
+        objs_tris += built.count;
+
+    clear_bvh(scene._bvh);
+    build_tri_tree(scene, scene._bvh, 0, objs_tris);
+
+    clear_bvh(scene._mesh_bvh);
+    scene._mesh_roots.clear();
+    for (const BuiltMesh& built: scene._built_meshes)
+        scene._mesh_roots.push_back(build_tri_tree(scene, scene._mesh_bvh, built.first, built.count));
+}
+
+/**
+ * Matrix times vector.
+ */
+inline Vec3 transform(const double m[3][3], const Vec3& v) {
+    return Vec3(
+        m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+        m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+        m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z
+    );
+}
+
+/**
+ * World space box of a mesh's tree placed by matrix and loc.
+ */
+AABB transform_box(const BVHNode& root, const double matrix[3][3], const Vec3& loc) {
+    AABB box;
+    for (int c = 0; c < 8; c++) {
+        Vec3 corner(c & 1 ? root.bmax.x : root.bmin.x, c & 2 ? root.bmax.y : root.bmin.y,
+            c & 4 ? root.bmax.z : root.bmin.z);
+        box.grow(transform(matrix, corner).add(loc));
+    }
+    return box;
+}
+
+bool instance_bounds(const Scene& scene, const Instance& inst, Vec3& bmin, Vec3& bmax) {
+    if (inst.mesh < 0 || inst.mesh >= (int)scene._mesh_roots.size() || scene._mesh_roots[inst.mesh] < 0)
+        return false;
+
+    AABB box = transform_box(scene._mesh_bvh.nodes[scene._mesh_roots[inst.mesh]], inst.matrix, inst.loc);
+    bmin = box.bmin;
+    bmax = box.bmax;
+    return true;
+}
+
+void build_instances(Scene& scene) {
+    scene._instances.clear();
+    clear_bvh(scene._tlas);
+
+    std::vector<AABB> boxes;
+    std::vector<int> items;
+    for (const Instance& inst: scene.instances) {
+        AABB box;
+        if (!instance_bounds(scene, inst, box.bmin, box.bmax))
+            continue;
+
+        InstanceData data;
+        invert(inst.matrix, data.inv);
+        data.loc = inst.loc;
+        data.color = inst.color;
+        data.root = scene._mesh_roots[inst.mesh];
+
+        items.push_back(scene._instances.size());
+        scene._instances.push_back(data);
+        boxes.push_back(box);
+    }
+
+    if (!items.empty())
+        build_tree(scene._tlas, boxes, items);
+    scene._built_instances = scene.instances;
+}
+
+bool scene_bounds(const Scene& scene, Vec3& bmin, Vec3& bmax) {
+    AABB box;
+    for (const BVH* bvh: {&scene._bvh, &scene._tlas}) {
+        if (!bvh->nodes.empty()) {
+            box.grow(bvh->nodes[0].bmin);
+            box.grow(bvh->nodes[0].bmax);
+        }
+    }
+    bmin = box.bmin;
+    bmax = box.bmax;
+    return box.bmin.x <= box.bmax.x;
+}
+
+void build_lights(Scene& scene) {
+    clear_bvh(scene._light_bvh);
+    scene._light_radii.clear();
+    if (scene.light_cutoff <= 0)
+        return;
+
+    // unshadowed, head on contribution to a white surface d away is
+    // power * color / d^2, under the cutoff past the radius
+    std::vector<AABB> boxes;
+    std::vector<int> items;
+    for (int i = 0; i < (int)scene.lights.size(); i++) {
+        const Light& light = scene.lights[i];
+        double peak = std::fabs(light.power) * max(light.color.x, light.color.y, light.color.z);
+        double radius = std::sqrt(std::max(peak, 0.0) / scene.light_cutoff);
+        Vec3 extent(radius, radius, radius);
+
+        AABB box;
+        box.grow(light.loc.sub(extent));
+        box.grow(light.loc.add(extent));
+        boxes.push_back(box);
+        items.push_back(i);
+        scene._light_radii.push_back(radius);
+    }
+
+    if (!items.empty())
+        build_tree(scene._light_bvh, boxes, items);
+}
+
+void lights_at(const Scene& scene, const Vec3& pt, std::vector<int>& lights) {
+    const Buffer<BVHNode>& nodes = scene._light_bvh.nodes;
+    if (nodes.empty())
+        return;
+
+    int stack[BVH_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    uint64_t visited = 0;
+
+    while (top > 0) {
+        const BVHNode& node = nodes[stack[--top]];
+        visited++;
+        if (pt.x < node.bmin.x || pt.y < node.bmin.y || pt.z < node.bmin.z
+                || pt.x > node.bmax.x || pt.y > node.bmax.y || pt.z > node.bmax.z)
+            continue;
+
+        if (node.count == 0) {
+            stack[top++] = node.first;
+            stack[top++] = &node - nodes.data() + 1;
+            continue;
+        }
+
+        for (int k = node.first; k < node.first + node.count; k++) {
+            int i = scene._light_bvh.indices[k];
+            double radius = scene._light_radii[i];
+            if (pt.sub(scene.lights[i].loc).sqsum() <= radius*radius)
+                lights.push_back(i);
+        }
+    }
+    _count(STAT_NODES, visited);
+}
+
+void refit_bvh(Scene& scene) {
+    BVH& bvh = scene._bvh;
+
+    // children come after their parent, so go backwards
+    for (int i = bvh.nodes.size() - 1; i >= 0; i--) {
+        BVHNode& node = bvh.nodes[i];
+        AABB box;
+
+        if (node.count == 0) {
+            for (const BVHNode* child: {&bvh.nodes[i+1], &bvh.nodes[node.first]}) {
+                box.grow(child->bmin);
+                box.grow(child->bmax);
+            }
+        } else {
+            for (int b = node.first; b < node.first + block_count(node.count); b++) {
+                TriBlock& block = bvh.blocks[b];
+                for (int lane = 0; lane < 4; lane++) {
+                    int index = block.face[lane];
+                    if (index < 0)
+                        continue;
+
+                    set_lane(scene, block, lane, index);
+                    for (int v: scene._tris[index].v)
+                        box.grow(scene._verts[v]);
+                }
+            }
+        }
+
+        node.bmin = box.bmin;
+        node.bmax = box.bmax;
+    }
+}
+
+
+/**
+ * Slab test. Returns distance to box along ray, or 1e300 if missed
+ * or farther than tmax.
+ */
+inline double intersect_box(const BVHNode& node, const Vec3& pt, const Vec3& inv, double tmax) {
+    double tx1 = (node.bmin.x - pt.x) * inv.x, tx2 = (node.bmax.x - pt.x) * inv.x;
+    double ty1 = (node.bmin.y - pt.y) * inv.y, ty2 = (node.bmax.y - pt.y) * inv.y;
+    double tz1 = (node.bmin.z - pt.z) * inv.z, tz2 = (node.bmax.z - pt.z) * inv.z;
+
+    double tnear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.0));
+    double tfar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), tmax));
+
+    return tnear <= tfar ? tnear : 1e300;
+}
+
+/**
+ * Visits the leaves of the tree at root whose boxes a ray hits before
+ * tmax, nearer children first. leaf may lower tmax.
+ */
+template <typename Leaf>
+inline void traverse(const Buffer<BVHNode>& nodes, int root, const Vec3& pt, const Vec3& inv,
+        const double& tmax, Leaf leaf) {
+    int stack[BVH_STACK];
+    int top = 0;
+    stack[top++] = root;
+    uint64_t visited = 0;
+
+    while (top > 0) {
+        const BVHNode& node = nodes[stack[--top]];
+        visited++;
+        if (intersect_box(node, pt, inv, tmax) >= 1e300)
+            continue;
+
+        if (node.count > 0) {
+            leaf(node);
+            continue;
+        }
+
+        // push the farther child first so the nearer one is visited first
+        int left = &node - nodes.data() + 1, right = node.first;
+        double dl = intersect_box(nodes[left], pt, inv, tmax);
+        double dr = intersect_box(nodes[right], pt, inv, tmax);
+        if (dl > dr) {
+            std::swap(left, right);
+            std::swap(dl, dr);
+        }
+        if (dr < 1e300)
+            stack[top++] = right;
+        if (dl < 1e300)
+            stack[top++] = left;
+    }
+    _count(STAT_NODES, visited);
+}
+
+/**
+ * Closest hit of a ray with the triangle tree of bvh at root before tmax.
+ * Returns the index in Scene._tris and lowers tmax to it, or returns -1.
+ */
+inline int trace_tree(const BVH& bvh, int root, const Vec3& pt, const Vec3& dir, const Vec3& inv, double& tmax) {
+    int hit = -1;
+    uint64_t tests = 0;
+    traverse(bvh.nodes, root, pt, inv, tmax, [&](const BVHNode& node) {
+        tests += node.count;
+        int lane = intersect_blocks(&bvh.blocks[node.first], block_count(node.count), pt, dir, tmax);
+        if (lane >= 0)
+            hit = bvh.blocks[node.first + lane/4].face[lane%4];
+    });
+    _count(STAT_FACE_TESTS, tests);
+    return hit;
+}
+
+/**
+ * Closest hit of a ray with the scene's instances before tmax.
+ * Returns the index in Scene._instances and sets tri, or returns -1.
+ * The ray is moved into mesh space, where distances in units of dir
+ * are unchanged, so tmax is shared with the world.
+ */
+inline int trace_instances(const Scene& scene, const Vec3& pt, const Vec3& dir, const Vec3& inv,
+        double& tmax, int& tri) {
+    if (scene._tlas.nodes.empty())
+        return -1;
+
+    int hit = -1;
+    traverse(scene._tlas.nodes, 0, pt, inv, tmax, [&](const BVHNode& node) {
+        for (int k = node.first; k < node.first + node.count; k++) {
+            int i = scene._tlas.indices[k];
+            const InstanceData& data = scene._instances[i];
+            Vec3 lpt = transform(data.inv, pt.sub(data.loc));
+            Vec3 ldir = transform(data.inv, dir);
+            Vec3 linv(1/ldir.x, 1/ldir.y, 1/ldir.z);
+
+            int t = trace_tree(scene._mesh_bvh, data.root, lpt, ldir, linv, tmax);
+            if (t >= 0) {
+                hit = i;
+                tri = t;
+            }
+        }
+    });
+    return hit;
+}
+
+/**
+ * Fills normal and color of ret for a hit on triangle tri of Scene._tris,
+ * of instance inst or -1 for objects.
+ */
+inline void set_surface(const Scene& scene, int tri, int inst, Intersect& ret) {
+    if (inst < 0) {
+        ret.normal = scene._normals[tri];
+        ret.color = scene._colors[scene._tri_objs[tri]];
+        return;
+    }
+
+    // normals go through the inverse transpose, keeping their length
+    const InstanceData& data = scene._instances[inst];
+    const Vec3& n = scene._normals[tri];
+    Vec3 normal(
+        data.inv[0][0]*n.x + data.inv[1][0]*n.y + data.inv[2][0]*n.z,
+        data.inv[0][1]*n.x + data.inv[1][1]*n.y + data.inv[2][1]*n.z,
+        data.inv[0][2]*n.x + data.inv[1][2]*n.y + data.inv[2][2]*n.z
+    );
+    double mag = normal.magnitude();
+    ret.normal = mag > 0 ? normal.mul(n.magnitude() / mag) : n;
+    ret.color = data.color;
+}
+
+/**
+ * Fill ret with a hit at t along the ray on triangle tri, of instance
+ * inst or -1 for objects.
+ */
+inline void set_hit(const Scene& scene, Intersect& ret, const Vec3& pt, const Vec3& dir, double len, double t,
+        int tri, int inst) {
+    ret.dist = t * len;
+    ret.pos = pt.add(dir.mul(t));
+    set_surface(scene, tri, inst, ret);
+}
+
+Intersect intersect(const Scene& scene, const Ray& ray) {
+    Intersect ret;
+    ret.dist = 1e9;
+    _count(STAT_RAYS, 1);
+
+    double len = ray.dir.magnitude();
+    Vec3 inv(1/ray.dir.x, 1/ray.dir.y, 1/ray.dir.z);
+    double tmax = ret.dist / len;  // in units of ray.dir
+
+    int tri = -1, inst = -1;
+    if (!scene._bvh.nodes.empty())
+        tri = trace_tree(scene._bvh, 0, ray.pt, ray.dir, inv, tmax);
+    int inst_tri;
+    inst = trace_instances(scene, ray.pt, ray.dir, inv, tmax, inst_tri);
+    if (inst >= 0)
+        tri = inst_tri;
+
+    if (tri >= 0)
+        set_hit(scene, ret, ray.pt, ray.dir, len, tmax, tri, inst);
+    return ret;
+}
+
+
+/**
+ * Conservative slab test of a whole packet against a box. Each axis of
+ * the inverse direction is the interval [lo, hi] over all rays, with one
+ * sign. False only if no ray of the packet can hit the box before tmax.
+ */
+inline bool intersect_box(const BVHNode& node, const Vec3& pt, const Vec3& lo, const Vec3& hi, double tmax) {
+    double nx = (lo.x > 0 ? node.bmin.x : node.bmax.x) - pt.x, fx = (lo.x > 0 ? node.bmax.x : node.bmin.x) - pt.x;
+    double ny = (lo.y > 0 ? node.bmin.y : node.bmax.y) - pt.y, fy = (lo.y > 0 ? node.bmax.y : node.bmin.y) - pt.y;
+    double nz = (lo.z > 0 ? node.bmin.z : node.bmax.z) - pt.z, fz = (lo.z > 0 ? node.bmax.z : node.bmin.z) - pt.z;
+
+    double tnear = std::max(
+        std::max(std::min(nx*lo.x, nx*hi.x), std::min(ny*lo.y, ny*hi.y)),
+        std::max(std::min(nz*lo.z, nz*hi.z), 0.0));
+    double tfar = std::min(
+        std::min(std::max(fx*lo.x, fx*hi.x), std::max(fy*lo.y, fy*hi.y)),
+        std::min(std::max(fz*lo.z, fz*hi.z), tmax));
+
+    return tnear <= tfar;
+}
+
+void intersect_packet(const Scene& scene, const RayPacket& packet, Intersect* ret) {
+    int n = packet.size;
+    for (int i = 0; i < n; i++)
+        ret[i].dist = 1e9;
+
+    const BVH& bvh = scene._bvh;
+    if (bvh.nodes.empty() && scene._tlas.nodes.empty())
+        return;
+
+    Vec3 inv[PACKET_SIZE];
+    double len[PACKET_SIZE], tmax[PACKET_SIZE];
+    Vec3 lo(1e300, 1e300, 1e300), hi(-1e300, -1e300, -1e300);
+    for (int i = 0; i < n; i++) {
+        const Vec3& d = packet.dir[i];
+        inv[i] = Vec3(1/d.x, 1/d.y, 1/d.z);
+        len[i] = d.magnitude();
+        tmax[i] = ret[i].dist / len[i];
+
+        lo = Vec3(std::min(lo.x, inv[i].x), std::min(lo.y, inv[i].y), std::min(lo.z, inv[i].z));
+        hi = Vec3(std::max(hi.x, inv[i].x), std::max(hi.y, inv[i].y), std::max(hi.z, inv[i].z));
+    }
+
+    // diverged packet, interval test needs one direction sign per axis
+    if (!(lo.x*hi.x > 0 && lo.y*hi.y > 0 && lo.z*hi.z > 0) || bvh.nodes.empty()) {
+        for (int i = 0; i < n; i++)
+            ret[i] = intersect(scene, Ray(packet.pt, packet.dir[i]));
+        return;
+    }
+
+    double packet_tmax = 0;
+    for (int i = 0; i < n; i++)
+        packet_tmax = std::max(packet_tmax, tmax[i]);
+    _count(STAT_RAYS, n);
+    uint64_t visited = 0, tests = 0;
+
+    // rays before `first` are known to miss the node
+    struct Entry {
+        int node, first;
+    };
+    Entry stack[BVH_STACK];
+    int top = 0;
+    stack[top++] = {0, 0};
+
+    while (top > 0) {
+        Entry entry = stack[--top];
+        const BVHNode& node = bvh.nodes[entry.node];
+        visited++;
+        if (!intersect_box(node, packet.pt, lo, hi, packet_tmax))
+            continue;
+
+        int first = entry.first;
+        while (first < n && intersect_box(node, packet.pt, inv[first], tmax[first]) >= 1e300)
+            first++;
+        if (first == n)
+            continue;
+
+        if (node.count > 0) {
+            for (int i = first; i < n; i++) {
+                if (i > first && intersect_box(node, packet.pt, inv[i], tmax[i]) >= 1e300)
+                    continue;
+                tests += node.count;
+
+                int lane = intersect_blocks(&bvh.blocks[node.first], block_count(node.count), packet.pt,
+                    packet.dir[i], tmax[i]);
+                if (lane >= 0) {
+                    int tri = bvh.blocks[node.first + lane/4].face[lane%4];
+                    set_hit(scene, ret[i], packet.pt, packet.dir[i], len[i], tmax[i], tri, -1);
+                }
+            }
+
+            packet_tmax = 0;
+            for (int i = 0; i < n; i++)
+                packet_tmax = std::max(packet_tmax, tmax[i]);
+            continue;
+        }
+
+        // order children by the first active ray
+        int left = entry.node + 1, right = node.first;
+        double dl = intersect_box(bvh.nodes[left], packet.pt, inv[first], tmax[first]);
+        double dr = intersect_box(bvh.nodes[right], packet.pt, inv[first], tmax[first]);
+        if (dl > dr)
+            std::swap(left, right);
+        stack[top++] = {right, first};
+        stack[top++] = {left, first};
+    }
+
+    _count(STAT_NODES, visited);
+    _count(STAT_FACE_TESTS, tests);
+
+    // instances per ray, culled by the objects' hits
+    for (int i = 0; i < n; i++) {
+        int tri;
+        int inst = trace_instances(scene, packet.pt, packet.dir[i], inv[i], tmax[i], tri);
+        if (inst >= 0)
+            set_hit(scene, ret[i], packet.pt, packet.dir[i], len[i], tmax[i], tri, inst);
+    }
+}
+
+
+}  // namespace Shadowmap
@@ -0,0 +1,157 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+constexpr char CACHE_MAGIC[8] = "SHMAPC";
+constexpr uint32_t CACHE_VERSION = 1;
+
+/**
+ * Header of a cache file. Pixel data follows at offset sizeof(CacheHeader).
+ */
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t w, h, layout, precision, tiled;
+    uint64_t key;
+    double depth_min, depth_max;
+    uint64_t bytes;  // of pixel data
+};
+
+static_assert(sizeof(CacheHeader) == 64, "pixel data must stay 64 byte aligned");
+
+
+/**
+ * FNV-1a over raw bytes.
+ */
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t hash_faces(const Scene& scene) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t count = scene._tris.size();
+    hash = fnv1a(hash, &count, sizeof(count));
+
+    for (const Tri& tri: scene._tris) {
+        for (int i = 0; i < 3; i++) {
+            const Vec3& p = scene._verts[tri.v[i]];
+            double pt[3] = {p.x, p.y, p.z};
+            hash = fnv1a(hash, pt, sizeof(pt));
+        }
+    }
+
+    for (const InstanceData& inst: scene._instances) {
+        double place[12] = {inst.loc.x, inst.loc.y, inst.loc.z};
+        memcpy(place + 3, inst.inv, sizeof(inst.inv));
+        hash = fnv1a(hash, place, sizeof(place));
+        hash = fnv1a(hash, &inst.root, sizeof(inst.root));
+    }
+    return hash;
+}
+
+uint64_t shadow_map_key(uint64_t faces_hash, const Light& light, const ShadowMap& map) {
+    double loc[3] = {light.loc.x, light.loc.y, light.loc.z};
+    int32_t params[5] = {map.w, map.h, map.layout, map.precision, map.tiled};
+
+    uint64_t hash = fnv1a(faces_hash, &CACHE_VERSION, sizeof(CACHE_VERSION));
+    hash = fnv1a(hash, loc, sizeof(loc));
+    hash = fnv1a(hash, params, sizeof(params));
+    return hash;
+}
+
+bool load_shadow_map(const std::string& path, uint64_t key, ShadowMap& map) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    size_t size = sizeof(CacheHeader) + map.bytes();
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const CacheHeader& header = *(const CacheHeader*)mapping;
+    bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+        && header.version == CACHE_VERSION && header.key == key
+        && header.w == map.w && header.h == map.h && header.layout == map.layout
+        && header.precision == map.precision && header.tiled == map.tiled
+        && header.bytes == map.bytes();
+    if (!valid) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    map.free();
+    map.data = (char*)mapping + sizeof(CacheHeader);
+    map.depth_min = header.depth_min;
+    map.depth_max = header.depth_max;
+    map._mapping = mapping;
+    map._mapping_size = size;
+    return true;
+}
+
+void save_shadow_map(const std::string& path, uint64_t key, const ShadowMap& map) {
+    CacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.w = map.w;
+    header.h = map.h;
+    header.layout = map.layout;
+    header.precision = map.precision;
+    header.tiled = map.tiled;
+    header.key = key;
+    header.depth_min = map.depth_min;
+    header.depth_max = map.depth_max;
+    header.bytes = map.bytes();
+
+    // write to a temporary file then rename, so readers never see a partial file
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    std::ofstream fp(tmp, std::ios::binary);
+    fp.write((const char*)&header, sizeof(header));
+    fp.write((const char*)map.data, map.bytes());
+    fp.close();
+
+    if (!fp || rename(tmp.c_str(), path.c_str()) != 0)
+        remove(tmp.c_str());
+}
+
+
+}  // namespace Shadowmap
@@ -0,0 +1,142 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <cstdlib>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+// kernels.cpp, compiled once per instruction set
+#define DECLARE_KERNELS(isa) \
+    namespace isa { \
+        int intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax); \
+        void light_weights(const ShadeBatch& batch, const Vec3& loc, double power, double radius, double* dist, \
+            double* weight); \
+        void shadow_texels(const ShadowMap& map, const ShadeBatch& batch, const Vec3& loc, int* x, int* y); \
+    }
+
+DECLARE_KERNELS(scalar)
+#if defined(__x86_64__) || defined(__i386__)
+#define SHADOWMAP_X86
+DECLARE_KERNELS(sse41)
+DECLARE_KERNELS(avx2)
+DECLARE_KERNELS(avx512)
+#endif
+
+
+/**
+ * One build of the kernels.
+ */
+struct KernelSet {
+    const char* name;
+    IntersectBlocksFn intersect_blocks;
+    decltype(&scalar::light_weights) light_weights;
+    decltype(&scalar::shadow_texels) shadow_texels;
+    bool (*supported)();
+};
+
+const KernelSet KERNEL_SETS[] = {
+#ifdef SHADOWMAP_X86
+    {"avx512", avx512::intersect_blocks, avx512::light_weights, avx512::shadow_texels, []{
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+    }},
+    {"avx2", avx2::intersect_blocks, avx2::light_weights, avx2::shadow_texels, []{
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }},
+    {"sse4.1", sse41::intersect_blocks, sse41::light_weights, sse41::shadow_texels, []{return (bool)__builtin_cpu_supports("sse4.1");}},
+#endif
+    {"scalar", scalar::intersect_blocks, scalar::light_weights, scalar::shadow_texels, []{return true;}},
+};
+
+std::atomic<const KernelSet*> current_kernels(nullptr);
+
+
+/**
+ * Kernels named isa, or the best supported for "auto".
+ * Null if unknown or not supported.
+ */
+const KernelSet* find_kernels(const std::string& isa) {
+    for (const KernelSet& set: KERNEL_SETS) {
+        if ((isa == "auto" || isa == set.name) && set.supported())
+            return &set;
+    }
+    return nullptr;
+}
+
+/**
+ * Pick kernels on first use, from SHADOWMAP_ISA or the CPU.
+ */
+const KernelSet* kernels() {
+    const KernelSet* set = current_kernels.load(std::memory_order_acquire);
+    if (set != nullptr)
+        return set;
+
+    const char* env = getenv("SHADOWMAP_ISA");
+    set = env ? find_kernels(env) : nullptr;
+    if (set == nullptr)
+        set = find_kernels("auto");
+    current_kernels.store(set, std::memory_order_release);
+    _intersect_blocks.store(set->intersect_blocks, std::memory_order_relaxed);
+    return set;
+}
+
+/**
+ * Initial _intersect_blocks, which picks the kernels and forwards.
+ */
+int resolve_intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax) {
+    return kernels()->intersect_blocks(blocks, count, pt, dir, tmax);
+}
+
+std::atomic<IntersectBlocksFn> _intersect_blocks(resolve_intersect_blocks);
+
+
+std::string kernel_isa() {
+    return kernels()->name;
+}
+
+bool set_kernel_isa(const std::string& isa) {
+    const KernelSet* set = find_kernels(isa);
+    if (set == nullptr)
+        return false;
+    current_kernels.store(set, std::memory_order_release);
+    _intersect_blocks.store(set->intersect_blocks, std::memory_order_relaxed);
+    return true;
+}
+
+void light_weights(const ShadeBatch& batch, const Vec3& loc, double power, double radius, double* dist,
+        double* weight) {
+    kernels()->light_weights(batch, loc, power, radius, dist, weight);
+}
+
+void shadow_texels(const ShadowMap& map, const ShadeBatch& batch, const Vec3& loc, int* x, int* y) {
+    kernels()->shadow_texels(map, batch, loc, x, y);
+}
+
+int intersect_block(const TriBlock& block, const Vec3& pt, const Vec3& dir, double tmax, double& t) {
+    int lane = intersect_blocks(&block, 1, pt, dir, tmax);
+    if (lane >= 0)
+        t = tmax;
+    return lane;
+}
+
+
+}  // namespace Shadowmap
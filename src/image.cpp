@@ -17,21 +17,28 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
 #include "shadowmap.hpp"
 
 
 namespace Shadowmap {
 
 
-Image::Image(int width, int height) {
+Image::Image(int width, int height, bool hdr) {
     w = width;
     h = height;
 
     data = new UCH[w * h * 3];
+    this->hdr = hdr ? new float[w * h * 3]() : nullptr;
 }
 
 Image::~Image() {
     delete[] data;
+    delete[] hdr;
 }
 
 UCH Image::get(int x, int y, int chn) {
@@ -49,23 +56,181 @@ void Image::write(std::ofstream& fp) {
 }
 
 
-ShadowMap::ShadowMap(int width, int height) {
+/**
+ * Bits of a 3 bit number spread to even positions, for Morton order.
+ */
+constexpr int MORTON[8] = {0, 1, 4, 5, 16, 17, 20, 21};
+
+ShadowMap::ShadowMap(int width, int height, ShadowLayout layout, ShadowPrecision precision, bool tiled) {
     w = width;
     h = height;
-
-    data = new double[w * h];
+    this->layout = layout;
+    this->precision = precision;
+    this->tiled = tiled;
+    depth_min = 0;
+    depth_max = 1e4;
+
+    data = new char[bytes()];
+    _mapping = nullptr;
+    _mapping_size = 0;
+    _moments = nullptr;
 }
 
 void ShadowMap::free() {
-    delete[] data;
+    if (_mapping != nullptr)
+        munmap(_mapping, _mapping_size);
+    else
+        delete[] (char*)data;
+    delete[] _moments;
+    _moments = nullptr;
+}
+
+void ShadowMap::own() {
+    if (_mapping == nullptr)
+        return;
+
+    char* copy = new char[bytes()];
+    memcpy(copy, data, bytes());
+    munmap(_mapping, _mapping_size);
+    data = copy;
+    _mapping = nullptr;
+    _mapping_size = 0;
+}
+
+int ShadowMap::index(int x, int y) const {
+    if (tiled) {
+        int tile = (y >> 3) * ((w+7) >> 3) + (x >> 3);
+        return (tile << 6) | MORTON[x & 7] | (MORTON[y & 7] << 1);
+    }
+    return y*w + x;
+}
+
+size_t ShadowMap::bytes() const {
+    size_t size = tiled ? (size_t)((w+7) >> 3) * ((h+7) >> 3) * 64 : (size_t)w * h;
+    switch (precision) {
+        case SHMAP_FLOAT: return size * sizeof(float);
+        case SHMAP_U16: return size * sizeof(uint16_t);
+        default: return size * sizeof(double);
+    }
 }
 
-double ShadowMap::get(int x, int y) {
-    return data[y*w + x];
+double ShadowMap::get(int x, int y) const {
+    int i = index(x, y);
+    switch (precision) {
+        case SHMAP_FLOAT:
+            return ((float*)data)[i];
+        case SHMAP_U16: {
+            uint16_t v = ((uint16_t*)data)[i];
+            if (v == 0xffff)
+                return 1e9;
+            return depth_min + v * (depth_max-depth_min) / 0xfffe;
+        }
+        default:
+            return ((double*)data)[i];
+    }
 }
 
 void ShadowMap::set(int x, int y, double value) {
-    data[y*w + x] = value;
+    int i = index(x, y);
+    switch (precision) {
+        case SHMAP_FLOAT:
+            ((float*)data)[i] = value;
+            break;
+        case SHMAP_U16: {
+            double v = ceil((value-depth_min) / (depth_max-depth_min) * 0xfffe);
+            ((uint16_t*)data)[i] = value >= depth_max ? 0xffff : (uint16_t)dbounds(v, 0, 0xfffe);
+            break;
+        }
+        default:
+            ((double*)data)[i] = value;
+    }
+}
+
+Vec3 ShadowMap::direction(int x, int y) const {
+    if (layout == SHMAP_CUBE) {
+        int face = x / h;
+        double u = (x % h + 0.5) / h * 2 - 1;
+        double v = (y + 0.5) / h * 2 - 1;
+        double c[3];
+        c[face/2] = face % 2 ? -1 : 1;
+        c[(face/2 + 1) % 3] = u;
+        c[(face/2 + 2) % 3] = v;
+        return Vec3(c[0], c[1], c[2]);
+    }
+
+    double tilt = ((double)y/h - 0.5) * PI;
+    double pan = ((double)x/w - 0.5) * PI * 2;
+    return Vec3(sin(pan)*cos(tilt), cos(pan)*cos(tilt), -sin(tilt));
+}
+
+void ShadowMap::pixel(const Vec3& dir, int& x, int& y) const {
+    if (layout == SHMAP_CUBE) {
+        double c[3] = {dir.x, dir.y, dir.z};
+        double ax = std::abs(dir.x), ay = std::abs(dir.y), az = std::abs(dir.z);
+        int a = ax >= ay ? (ax >= az ? 0 : 2) : (ay >= az ? 1 : 2);
+        double inv = 0.5 / std::abs(c[a]);
+        int face = 2*a + (c[a] < 0);
+
+        x = bounds((int)((c[(a+1) % 3]*inv + 0.5) * h), 0, h-1) + face*h;
+        y = bounds((int)((c[(a+2) % 3]*inv + 0.5) * h), 0, h-1);
+        return;
+    }
+
+    double tilt = atan2(-dir.z, distance(dir.x, dir.y));
+    double pan = atan2(dir.x, dir.y);
+    y = bounds((int)((tilt/PI + 0.5) * h), 0, h-1);
+    x = bounds((int)((pan/PI/2 + 0.5) * w), 0, w-1);
+}
+
+void ShadowMap::prefilter() {
+    double far = 0;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double d = get(x, y);
+            if (d < 1e9)
+                far = std::max(far, d);
+        }
+    }
+    far = far*2 + 1;
+
+    // entry (x, y) sums texels above and left of it, two doubles each
+    delete[] _moments;
+    size_t stride = w + 1;
+    _moments = new double[2 * stride * (h+1)]();
+    for (int y = 0; y < h; y++) {
+        double sum = 0, sqsum = 0;
+        for (int x = 0; x < w; x++) {
+            double d = get(x, y);
+            d = d < 1e9 ? d : far;
+            sum += d;
+            sqsum += d*d;
+            double* out = _moments + 2*((y+1)*stride + x+1);
+            const double* above = _moments + 2*(y*stride + x+1);
+            out[0] = above[0] + sum;
+            out[1] = above[1] + sqsum;
+        }
+    }
+}
+
+void ShadowMap::filtered(const Vec3& dir, int radius, double& mean, double& sqmean) const {
+    int x, y;
+    pixel(dir, x, y);
+    int xmin = 0, xmax = w-1;
+    if (layout == SHMAP_CUBE) {
+        xmin = x / h * h;
+        xmax = xmin + h-1;
+    }
+    int x0 = std::max(x-radius, xmin), x1 = std::min(x+radius, xmax) + 1;
+    int y0 = std::max(y-radius, 0), y1 = std::min(y+radius, h-1) + 1;
+
+    size_t stride = w + 1;
+    const double* a = _moments + 2*(y0*stride + x0);
+    const double* b = _moments + 2*(y0*stride + x1);
+    const double* c = _moments + 2*(y1*stride + x0);
+    const double* d = _moments + 2*(y1*stride + x1);
+    double n = (double)(x1-x0) * (y1-y0);
+    mean = (d[0] - b[0] - c[0] + a[0]) / n;
+    sqmean = (d[1] - b[1] - c[1] + a[1]) / n;
 }
 
 
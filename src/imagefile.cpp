@@ -0,0 +1,383 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+constexpr int DEFLATE_WINDOW = 32768;
+constexpr int DEFLATE_HASH = 1 << 15;
+constexpr int DEFLATE_CHAIN = 16;  // match candidates tried per position
+constexpr int DEFLATE_MAX_MATCH = 258;
+
+constexpr int LEN_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr int LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr int DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+constexpr int DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/**
+ * CRC-32 as used by PNG chunks.
+ */
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/**
+ * Streaming zlib compressor: LZ77 over hash chains, fixed Huffman codes.
+ * Each compress() call ends a deflate block so its output can be written
+ * right away; matches still reach back into earlier calls' data.
+ */
+struct Deflater {
+    std::vector<uint8_t> hist;  // window of past input, then the current input
+    int64_t hist_base;  // stream position of hist[0]
+    std::vector<int64_t> head, prev;  // hash chains of stream positions, -1 for none
+    uint32_t adler_a, adler_b;
+    uint32_t bits;
+    int bit_count;
+    std::vector<uint8_t> out;  // compressed bytes not yet taken by the caller
+
+    Deflater(): hist_base(0), head(DEFLATE_HASH, -1), prev(DEFLATE_WINDOW, -1),
+            adler_a(1), adler_b(0), bits(0), bit_count(0) {
+        out = {0x78, 0x01};  // zlib header: deflate, 32K window, fastest level
+    }
+
+    void put_bits(uint32_t value, int count) {
+        bits |= value << bit_count;
+        bit_count += count;
+        while (bit_count >= 8) {
+            out.push_back(bits & 0xff);
+            bits >>= 8;
+            bit_count -= 8;
+        }
+    }
+
+    /**
+     * Huffman codes are packed starting from their most significant bit.
+     */
+    void put_code(uint32_t code, int len) {
+        uint32_t rev = 0;
+        for (int i = 0; i < len; i++)
+            rev = (rev << 1) | ((code >> i) & 1);
+        put_bits(rev, len);
+    }
+
+    void put_symbol(int v) {
+        if (v < 144)
+            put_code(0x30 + v, 8);
+        else if (v < 256)
+            put_code(0x190 + v - 144, 9);
+        else if (v < 280)
+            put_code(v - 256, 7);
+        else
+            put_code(0xc0 + v - 280, 8);
+    }
+
+    void put_match(int len, int dist) {
+        int l = 28;
+        while (LEN_BASE[l] > len)
+            l--;
+        put_symbol(257 + l);
+        put_bits(len - LEN_BASE[l], LEN_EXTRA[l]);
+
+        int d = 29;
+        while (DIST_BASE[d] > dist)
+            d--;
+        put_code(d, 5);
+        put_bits(dist - DIST_BASE[d], DIST_EXTRA[d]);
+    }
+
+    static uint32_t hash(const uint8_t* p) {
+        return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 17;
+    }
+
+    void insert(size_t i) {
+        int64_t pos = hist_base + i;
+        uint32_t h = hash(&hist[i]);
+        prev[pos & (DEFLATE_WINDOW-1)] = head[h];
+        head[h] = pos;
+    }
+
+    void compress(const uint8_t* data, size_t size, bool final) {
+        for (size_t i = 0; i < size; i += 5552) {
+            for (size_t j = i; j < std::min(i + 5552, size); j++) {
+                adler_a += data[j];
+                adler_b += adler_a;
+            }
+            adler_a %= 65521;
+            adler_b %= 65521;
+        }
+
+        // keep one window of history before the new input
+        if (hist.size() > 2*DEFLATE_WINDOW) {
+            size_t drop = hist.size() - DEFLATE_WINDOW;
+            hist.erase(hist.begin(), hist.begin() + drop);
+            hist_base += drop;
+        }
+        size_t i = hist.size();
+        hist.insert(hist.end(), data, data + size);
+        size_t end = hist.size();
+
+        put_bits(final ? 1 : 0, 1);
+        put_bits(1, 2);  // fixed Huffman codes
+
+        while (i < end) {
+            int best_len = 0, best_dist = 0;
+            if (i + 3 <= end) {
+                int64_t pos = hist_base + i;
+                int64_t cand = head[hash(&hist[i])];
+                int max_len = std::min<size_t>(DEFLATE_MAX_MATCH, end - i);
+
+                for (int c = 0; c < DEFLATE_CHAIN && cand >= 0 && pos - cand <= DEFLATE_WINDOW; c++) {
+                    const uint8_t* a = &hist[cand - hist_base];
+                    const uint8_t* b = &hist[i];
+                    int len = 0;
+                    while (len < max_len && a[len] == b[len])
+                        len++;
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = pos - cand;
+                        if (len == max_len)
+                            break;
+                    }
+
+                    // chain slots are reused once a position leaves the window
+                    int64_t next = prev[cand & (DEFLATE_WINDOW-1)];
+                    if (next >= cand)
+                        break;
+                    cand = next;
+                }
+                insert(i);
+            }
+
+            if (best_len >= 3) {
+                put_match(best_len, best_dist);
+                for (size_t k = i+1; k < i + best_len && k + 3 <= end; k++)
+                    insert(k);
+                i += best_len;
+            } else {
+                put_symbol(hist[i]);
+                i++;
+            }
+        }
+        put_symbol(256);
+
+        if (final) {
+            if (bit_count > 0)
+                put_bits(0, 8 - bit_count);
+            uint32_t adler = adler_b << 16 | adler_a;
+            for (int k = 3; k >= 0; k--)
+                out.push_back(adler >> (8*k));
+        }
+    }
+};
+
+
+/**
+ * Format from the file name's extension, raw if unknown.
+ */
+ImageFormat image_format(const std::string& filename) {
+    std::string ext = filename.substr(std::min(filename.rfind('.'), filename.size()));
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".png")
+        return IMAGE_PNG;
+    if (ext == ".ppm")
+        return IMAGE_PPM;
+    if (ext == ".pfm")
+        return IMAGE_PFM;
+    return IMAGE_RAW;
+}
+
+/**
+ * Write a 32 bit big endian integer.
+ */
+void put_u32(std::vector<uint8_t>& buf, uint32_t v) {
+    for (int k = 3; k >= 0; k--)
+        buf.push_back(v >> (8*k));
+}
+
+/**
+ * Paeth predictor of PNG filter type 4.
+ */
+inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+ImageWriter::ImageWriter(const std::string& filename, int w, int h):
+        ImageWriter(filename, w, h, image_format(filename)) {
+}
+
+ImageWriter::ImageWriter(const std::string& filename, int w, int h, ImageFormat format) {
+    this->w = w;
+    this->h = h;
+    this->format = format;
+    _next = 0;
+    _closed = false;
+    _fp.open(filename, std::ios::binary);
+
+    char header[64];
+    switch (format) {
+        case IMAGE_PPM:
+            _fp.write(header, snprintf(header, sizeof(header), "P6\n%d %d\n255\n", w, h));
+            break;
+        case IMAGE_PFM:
+            // negative scale means little endian
+            _header = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", w, h);
+            _fp.write(header, _header);
+            break;
+        case IMAGE_PNG: {
+            const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+            _fp.write((const char*)signature, 8);
+
+            std::vector<uint8_t> ihdr;
+            put_u32(ihdr, w);
+            put_u32(ihdr, h);
+            ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});  // 8 bit rgb, no interlace
+            _chunk("IHDR", ihdr);
+
+            _deflate.reset(new Deflater());
+            _prev.assign(3*w, 0);
+            break;
+        }
+        default:
+            _fp.write((const char*)&w, sizeof(int));
+            _fp.write((const char*)&h, sizeof(int));
+    }
+}
+
+ImageWriter::~ImageWriter() {
+    close();
+}
+
+void ImageWriter::_chunk(const char* type, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> buf;
+    put_u32(buf, data.size());
+    buf.insert(buf.end(), type, type + 4);
+    buf.insert(buf.end(), data.begin(), data.end());
+    put_u32(buf, crc32(0, buf.data() + 4, buf.size() - 4));
+    _fp.write((const char*)buf.data(), buf.size());
+}
+
+bool ImageWriter::write_rows(const Image& img, int y0, int y1) {
+    if (_closed || y0 != _next || y1 > h || img.w != w)
+        return false;
+
+    if (format == IMAGE_PFM) {
+        // rows are stored bottom to top
+        std::vector<float> row(3*w);
+        for (int y = y0; y < y1; y++) {
+            for (int i = 0; i < 3*w; i++)
+                row[i] = img.hdr ? img.hdr[3*y*w + i] : img.data[3*y*w + i] / 255.0f;
+            _fp.seekp(_header + (size_t)(h-1-y) * row.size() * sizeof(float));
+            _fp.write((const char*)row.data(), row.size() * sizeof(float));
+        }
+    } else if (format == IMAGE_PNG) {
+        // each row gets the filter with the smallest sum of absolute
+        // residuals, a cheap estimate of what compresses best
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> filtered[5];
+        for (int y = y0; y < y1; y++) {
+            const uint8_t* cur = img.data + 3*y*w;
+            int best = 0;
+            long best_sum = -1;
+            for (int f = 0; f < 5; f++) {
+                filtered[f].resize(3*w);
+                long sum = 0;
+                for (int i = 0; i < 3*w; i++) {
+                    int a = i >= 3 ? cur[i-3] : 0, b = _prev[i], c = i >= 3 ? _prev[i-3] : 0;
+                    int pred = f == 0 ? 0 : f == 1 ? a : f == 2 ? b : f == 3 ? (a+b) / 2 : paeth(a, b, c);
+                    uint8_t v = cur[i] - pred;
+                    filtered[f][i] = v;
+                    sum += v < 128 ? v : 256 - v;
+                }
+                if (best_sum < 0 || sum < best_sum) {
+                    best = f;
+                    best_sum = sum;
+                }
+            }
+
+            raw.push_back(best);
+            raw.insert(raw.end(), filtered[best].begin(), filtered[best].end());
+            memcpy(_prev.data(), cur, 3*w);
+        }
+
+        _deflate->compress(raw.data(), raw.size(), false);
+        _chunk("IDAT", _deflate->out);
+        _deflate->out.clear();
+    } else {
+        _fp.write((const char*)img.data + 3*y0*w, (size_t)3 * w * (y1-y0));
+    }
+
+    _next = y1;
+    return (bool)_fp;
+}
+
+bool ImageWriter::close() {
+    if (_closed)
+        return (bool)_fp;
+    _closed = true;
+
+    if (format == IMAGE_PNG) {
+        _deflate->compress(nullptr, 0, true);
+        _chunk("IDAT", _deflate->out);
+        _chunk("IEND", {});
+    }
+
+    _fp.close();
+    return _next == h && !_fp.fail();
+}
+
+
+bool Image::save(const std::string& filename) {
+    ImageWriter writer(filename, w, h);
+    writer.write_rows(*this, 0, h);
+    return writer.close();
+}
+
+
+}  // namespace Shadowmap
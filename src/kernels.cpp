@@ -0,0 +1,388 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+//
+//  Intersection and shading kernels. This file is compiled once per
+//  instruction set with KERNEL_ISA naming the namespace, e.g. -mavx2 -mfma
+//  -DKERNEL_ISA=avx2, and cpu.cpp picks one at runtime.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "shadowmap.hpp"
+
+#if defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#ifndef KERNEL_ISA
+#define KERNEL_ISA scalar
+#endif
+
+
+namespace Shadowmap {
+namespace KERNEL_ISA {
+
+
+constexpr double KERNEL_EPS = 1e-9;  // barycentric slack so shared edges don't leak
+
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+/**
+ * Möller-Trumbore on the 4 lanes of block. Returns the mask of lanes hit
+ * before tmax and sets dist, with lanes not hit at infinity.
+ */
+inline int hit_lanes(const TriBlock& block, const Vec3& pt, const Vec3& dir, double tmax, __m256d& dist) {
+    __m256d dx = _mm256_set1_pd(dir.x), dy = _mm256_set1_pd(dir.y), dz = _mm256_set1_pd(dir.z);
+
+    __m256d e1x = _mm256_load_pd(block.e1[0]), e1y = _mm256_load_pd(block.e1[1]), e1z = _mm256_load_pd(block.e1[2]);
+    __m256d e2x = _mm256_load_pd(block.e2[0]), e2y = _mm256_load_pd(block.e2[1]), e2z = _mm256_load_pd(block.e2[2]);
+
+    // p = dir x e2
+    __m256d px = _mm256_fmsub_pd(dy, e2z, _mm256_mul_pd(dz, e2y));
+    __m256d py = _mm256_fmsub_pd(dz, e2x, _mm256_mul_pd(dx, e2z));
+    __m256d pz = _mm256_fmsub_pd(dx, e2y, _mm256_mul_pd(dy, e2x));
+    __m256d det = _mm256_fmadd_pd(e1x, px, _mm256_fmadd_pd(e1y, py, _mm256_mul_pd(e1z, pz)));
+    __m256d inv = _mm256_div_pd(_mm256_set1_pd(1), det);
+
+    // s = pt - p1
+    __m256d sx = _mm256_sub_pd(_mm256_set1_pd(pt.x), _mm256_load_pd(block.p1[0]));
+    __m256d sy = _mm256_sub_pd(_mm256_set1_pd(pt.y), _mm256_load_pd(block.p1[1]));
+    __m256d sz = _mm256_sub_pd(_mm256_set1_pd(pt.z), _mm256_load_pd(block.p1[2]));
+    __m256d u = _mm256_mul_pd(_mm256_fmadd_pd(sx, px, _mm256_fmadd_pd(sy, py, _mm256_mul_pd(sz, pz))), inv);
+
+    // q = s x e1
+    __m256d qx = _mm256_fmsub_pd(sy, e1z, _mm256_mul_pd(sz, e1y));
+    __m256d qy = _mm256_fmsub_pd(sz, e1x, _mm256_mul_pd(sx, e1z));
+    __m256d qz = _mm256_fmsub_pd(sx, e1y, _mm256_mul_pd(sy, e1x));
+    __m256d v = _mm256_mul_pd(_mm256_fmadd_pd(dx, qx, _mm256_fmadd_pd(dy, qy, _mm256_mul_pd(dz, qz))), inv);
+    __m256d d = _mm256_mul_pd(_mm256_fmadd_pd(e2x, qx, _mm256_fmadd_pd(e2y, qy, _mm256_mul_pd(e2z, qz))), inv);
+
+    __m256d eps = _mm256_set1_pd(-KERNEL_EPS);
+    __m256d mask = _mm256_cmp_pd(_mm256_andnot_pd(_mm256_set1_pd(-0.0), det), _mm256_set1_pd(1e-300), _CMP_GT_OQ);
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(u, eps, _CMP_GE_OQ));
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(v, eps, _CMP_GE_OQ));
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(_mm256_add_pd(u, v), _mm256_set1_pd(1+KERNEL_EPS), _CMP_LE_OQ));
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(d, _mm256_set1_pd(KERNEL_EPS), _CMP_GT_OQ));
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(d, _mm256_set1_pd(tmax), _CMP_LT_OQ));
+
+    dist = _mm256_blendv_pd(_mm256_set1_pd(INFINITY), d, mask);
+    return _mm256_movemask_pd(mask);
+}
+
+/**
+ * Closest lane of block hit before tmax, lowering tmax, or -1.
+ */
+inline int intersect4(const TriBlock& block, const Vec3& pt, const Vec3& dir, double& tmax) {
+    __m256d d;
+    int bits = hit_lanes(block, pt, dir, tmax, d);
+    if (bits == 0)
+        return -1;
+
+    // horizontal min over hit lanes
+    __m256d m = _mm256_min_pd(d, _mm256_permute4x64_pd(d, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_pd(m, _mm256_permute_pd(m, 0b0101));
+    tmax = _mm256_cvtsd_f64(m);
+    return __builtin_ctz(_mm256_movemask_pd(_mm256_cmp_pd(d, m, _CMP_EQ_OQ)) & bits);
+}
+
+#endif
+
+
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+
+/**
+ * Two consecutive blocks as one 8 wide register. The high half is merged
+ * by a masked broadcast, as _mm512_insertf64x4() reads an undefined
+ * placeholder that GCC warns about.
+ */
+inline __m512d load8(const double* lo, const double* hi) {
+    __m512d v = _mm512_castpd256_pd512(_mm256_load_pd(lo));
+    return _mm512_mask_broadcast_f64x4(v, 0xf0, _mm256_load_pd(hi));
+}
+
+/**
+ * Closest lane of blocks a and b = a+1 hit before tmax, lowering tmax, or -1.
+ * Lanes of b are 4 to 7.
+ */
+inline int intersect8(const TriBlock& a, const Vec3& pt, const Vec3& dir, double& tmax) {
+    const TriBlock& b = (&a)[1];
+    __m512d dx = _mm512_set1_pd(dir.x), dy = _mm512_set1_pd(dir.y), dz = _mm512_set1_pd(dir.z);
+
+    __m512d e1x = load8(a.e1[0], b.e1[0]), e1y = load8(a.e1[1], b.e1[1]), e1z = load8(a.e1[2], b.e1[2]);
+    __m512d e2x = load8(a.e2[0], b.e2[0]), e2y = load8(a.e2[1], b.e2[1]), e2z = load8(a.e2[2], b.e2[2]);
+
+    __m512d px = _mm512_fmsub_pd(dy, e2z, _mm512_mul_pd(dz, e2y));
+    __m512d py = _mm512_fmsub_pd(dz, e2x, _mm512_mul_pd(dx, e2z));
+    __m512d pz = _mm512_fmsub_pd(dx, e2y, _mm512_mul_pd(dy, e2x));
+    __m512d det = _mm512_fmadd_pd(e1x, px, _mm512_fmadd_pd(e1y, py, _mm512_mul_pd(e1z, pz)));
+    __m512d inv = _mm512_div_pd(_mm512_set1_pd(1), det);
+
+    __m512d sx = _mm512_sub_pd(_mm512_set1_pd(pt.x), load8(a.p1[0], b.p1[0]));
+    __m512d sy = _mm512_sub_pd(_mm512_set1_pd(pt.y), load8(a.p1[1], b.p1[1]));
+    __m512d sz = _mm512_sub_pd(_mm512_set1_pd(pt.z), load8(a.p1[2], b.p1[2]));
+    __m512d u = _mm512_mul_pd(_mm512_fmadd_pd(sx, px, _mm512_fmadd_pd(sy, py, _mm512_mul_pd(sz, pz))), inv);
+
+    __m512d qx = _mm512_fmsub_pd(sy, e1z, _mm512_mul_pd(sz, e1y));
+    __m512d qy = _mm512_fmsub_pd(sz, e1x, _mm512_mul_pd(sx, e1z));
+    __m512d qz = _mm512_fmsub_pd(sx, e1y, _mm512_mul_pd(sy, e1x));
+    __m512d v = _mm512_mul_pd(_mm512_fmadd_pd(dx, qx, _mm512_fmadd_pd(dy, qy, _mm512_mul_pd(dz, qz))), inv);
+    __m512d d = _mm512_mul_pd(_mm512_fmadd_pd(e2x, qx, _mm512_fmadd_pd(e2y, qy, _mm512_mul_pd(e2z, qz))), inv);
+
+    __m512d eps = _mm512_set1_pd(-KERNEL_EPS);
+    __mmask8 mask = _mm512_cmp_pd_mask(_mm512_abs_pd(det), _mm512_set1_pd(1e-300), _CMP_GT_OQ);
+    mask &= _mm512_cmp_pd_mask(u, eps, _CMP_GE_OQ);
+    mask &= _mm512_cmp_pd_mask(v, eps, _CMP_GE_OQ);
+    mask &= _mm512_cmp_pd_mask(_mm512_add_pd(u, v), _mm512_set1_pd(1+KERNEL_EPS), _CMP_LE_OQ);
+    mask &= _mm512_cmp_pd_mask(d, _mm512_set1_pd(KERNEL_EPS), _CMP_GT_OQ);
+    mask &= _mm512_cmp_pd_mask(d, _mm512_set1_pd(tmax), _CMP_LT_OQ);
+    if (mask == 0)
+        return -1;
+
+    // horizontal min over hit lanes, avoiding the intrinsics that read an
+    // undefined placeholder, like _mm512_mask_reduce_min_pd()
+    __m512d hit = _mm512_mask_blend_pd(mask, _mm512_set1_pd(INFINITY), d);
+    __m256d h = _mm256_min_pd(_mm512_maskz_extractf64x4_pd(0xf, hit, 0), _mm512_maskz_extractf64x4_pd(0xf, hit, 1));
+    h = _mm256_min_pd(h, _mm256_permute4x64_pd(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    h = _mm256_min_pd(h, _mm256_permute_pd(h, 0b0101));
+    double m = _mm256_cvtsd_f64(h);
+    tmax = m;
+    return __builtin_ctz(_mm512_mask_cmp_pd_mask(mask, d, _mm512_set1_pd(m), _CMP_EQ_OQ));
+}
+
+int intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax) {
+    int ret = -1;
+    int b = 0;
+    for (; b + 1 < count; b += 2) {
+        int lane = intersect8(blocks[b], pt, dir, tmax);
+        if (lane >= 0)
+            ret = 4*b + lane;
+    }
+    if (b < count) {
+        int lane = intersect4(blocks[b], pt, dir, tmax);
+        if (lane >= 0)
+            ret = 4*b + lane;
+    }
+    return ret;
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+int intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax) {
+    int ret = -1;
+    for (int b = 0; b < count; b++) {
+        int lane = intersect4(blocks[b], pt, dir, tmax);
+        if (lane >= 0)
+            ret = 4*b + lane;
+    }
+    return ret;
+}
+
+#elif defined(__SSE4_1__)
+
+/**
+ * Lanes 2*half and 2*half+1 of block. Sets the lane hit closest before
+ * tmax and lowers tmax, or leaves both unchanged.
+ */
+inline void intersect2(const TriBlock& block, int half, const Vec3& pt, const Vec3& dir, double& tmax, int& lane) {
+    int o = 2 * half;
+    __m128d dx = _mm_set1_pd(dir.x), dy = _mm_set1_pd(dir.y), dz = _mm_set1_pd(dir.z);
+
+    __m128d e1x = _mm_load_pd(block.e1[0] + o), e1y = _mm_load_pd(block.e1[1] + o), e1z = _mm_load_pd(block.e1[2] + o);
+    __m128d e2x = _mm_load_pd(block.e2[0] + o), e2y = _mm_load_pd(block.e2[1] + o), e2z = _mm_load_pd(block.e2[2] + o);
+
+    __m128d px = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+    __m128d py = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+    __m128d pz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+    __m128d det = _mm_add_pd(_mm_mul_pd(e1x, px), _mm_add_pd(_mm_mul_pd(e1y, py), _mm_mul_pd(e1z, pz)));
+    __m128d inv = _mm_div_pd(_mm_set1_pd(1), det);
+
+    __m128d sx = _mm_sub_pd(_mm_set1_pd(pt.x), _mm_load_pd(block.p1[0] + o));
+    __m128d sy = _mm_sub_pd(_mm_set1_pd(pt.y), _mm_load_pd(block.p1[1] + o));
+    __m128d sz = _mm_sub_pd(_mm_set1_pd(pt.z), _mm_load_pd(block.p1[2] + o));
+    __m128d u = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(sx, px), _mm_add_pd(_mm_mul_pd(sy, py), _mm_mul_pd(sz, pz))), inv);
+
+    __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+    __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+    __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+    __m128d v = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_add_pd(_mm_mul_pd(dy, qy), _mm_mul_pd(dz, qz))), inv);
+    __m128d d = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_add_pd(_mm_mul_pd(e2y, qy), _mm_mul_pd(e2z, qz))), inv);
+
+    __m128d eps = _mm_set1_pd(-KERNEL_EPS);
+    __m128d mask = _mm_cmpgt_pd(_mm_andnot_pd(_mm_set1_pd(-0.0), det), _mm_set1_pd(1e-300));
+    mask = _mm_and_pd(mask, _mm_cmpge_pd(u, eps));
+    mask = _mm_and_pd(mask, _mm_cmpge_pd(v, eps));
+    mask = _mm_and_pd(mask, _mm_cmple_pd(_mm_add_pd(u, v), _mm_set1_pd(1+KERNEL_EPS)));
+    mask = _mm_and_pd(mask, _mm_cmpgt_pd(d, _mm_set1_pd(KERNEL_EPS)));
+    mask = _mm_and_pd(mask, _mm_cmplt_pd(d, _mm_set1_pd(tmax)));
+
+    int bits = _mm_movemask_pd(mask);
+    if (bits == 0)
+        return;
+
+    double dist[2];
+    _mm_storeu_pd(dist, _mm_blendv_pd(_mm_set1_pd(INFINITY), d, mask));
+    int i = dist[1] < dist[0];
+    tmax = dist[i];
+    lane = o + i;
+}
+
+int intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax) {
+    int ret = -1;
+    for (int b = 0; b < count; b++) {
+        for (int half = 0; half < 2; half++) {
+            int lane = -1;
+            intersect2(blocks[b], half, pt, dir, tmax, lane);
+            if (lane >= 0)
+                ret = 4*b + lane;
+        }
+    }
+    return ret;
+}
+
+#else
+
+int intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax) {
+    int ret = -1;
+
+    for (int b = 0; b < count; b++) {
+        const TriBlock& block = blocks[b];
+        for (int i = 0; i < 4; i++) {
+            double e1x = block.e1[0][i], e1y = block.e1[1][i], e1z = block.e1[2][i];
+            double e2x = block.e2[0][i], e2y = block.e2[1][i], e2z = block.e2[2][i];
+
+            double px = dir.y*e2z - dir.z*e2y;
+            double py = dir.z*e2x - dir.x*e2z;
+            double pz = dir.x*e2y - dir.y*e2x;
+            double det = e1x*px + e1y*py + e1z*pz;
+            if (std::abs(det) <= 1e-300)
+                continue;
+            double inv = 1 / det;
+
+            double sx = pt.x - block.p1[0][i], sy = pt.y - block.p1[1][i], sz = pt.z - block.p1[2][i];
+            double u = (sx*px + sy*py + sz*pz) * inv;
+
+            double qx = sy*e1z - sz*e1y;
+            double qy = sz*e1x - sx*e1z;
+            double qz = sx*e1y - sy*e1x;
+            double v = (dir.x*qx + dir.y*qy + dir.z*qz) * inv;
+            double dist = (e2x*qx + e2y*qy + e2z*qz) * inv;
+
+            if (u >= -KERNEL_EPS && v >= -KERNEL_EPS && u+v <= 1+KERNEL_EPS && dist > KERNEL_EPS && dist < tmax) {
+                tmax = dist;
+                ret = 4*b + i;
+            }
+        }
+    }
+
+    return ret;
+}
+
+#endif
+
+
+// Shading kernels. These are plain loops over a batch, with every branch
+// written as a select, left to the compiler to vectorize for each
+// instruction set.
+
+// atan() of Cephes, rational approximation on [0, tan(pi/8)]
+constexpr double ATAN_P[5] = {-8.750608600031904122785e-1, -1.615753718733365076637e1,
+    -7.500855792314704667340e1, -1.228866684490136173410e2, -6.485021904942025371773e1};
+constexpr double ATAN_Q[5] = {2.485846490142306297962e1, 1.650270098316988542046e2,
+    4.328810604912902668951e2, 4.853903996359136964868e2, 1.945506571482613964425e2};
+constexpr double ATAN_MOREBITS = 6.123233995736765886130e-17;  // pi/2 - (double)(pi/2)
+
+/**
+ * Arctangent of t >= 0, within a few ulp of atan().
+ */
+inline double atan_pos(double t) {
+    bool big = t > 2.414213562373095, mid = t > 0.66;  // tan(3pi/8)
+    double inv = -1 / t, shift = (t-1) / (t+1);
+    double x = big ? inv : (mid ? shift : t);
+    double base = big ? PI/2 + ATAN_MOREBITS : (mid ? PI/4 + ATAN_MOREBITS/2 : 0);
+
+    double z = x*x;
+    double p = (((ATAN_P[0]*z + ATAN_P[1])*z + ATAN_P[2])*z + ATAN_P[3])*z + ATAN_P[4];
+    double q = ((((z + ATAN_Q[0])*z + ATAN_Q[1])*z + ATAN_Q[2])*z + ATAN_Q[3])*z + ATAN_Q[4];
+    return base + (x + x*z*p/q);
+}
+
+/**
+ * atan2(y, x), 0 if both are 0.
+ */
+inline double atan2_pos(double y, double x) {
+    double ax = std::abs(x), ay = std::abs(y), t = ay / ax;
+    double a = atan_pos(ay == 0 ? 0 : t);
+    a = x < 0 ? PI - a : a;
+    return y < 0 ? -a : a;
+}
+
+/**
+ * Clamp v to [0, hi] and truncate.
+ */
+inline int texel(double v, int hi) {
+    return (int)std::min(std::max(v, 0.0), (double)hi);
+}
+
+void light_weights(const ShadeBatch& batch, const Vec3& loc, double power, double radius,
+        double* __restrict dist, double* __restrict weight) {
+    for (int i = 0, n = batch.count; i < n; i++) {
+        double dx = loc.x - batch.pos[0][i], dy = loc.y - batch.pos[1][i], dz = loc.z - batch.pos[2][i];
+        double d2 = dx*dx + dy*dy + dz*dz;
+        double d = std::sqrt(d2);
+        double cos = (dx*batch.normal[0][i] + dy*batch.normal[1][i] + dz*batch.normal[2][i]) / d;
+        double w = power * cos / d2;
+        dist[i] = d;
+        weight[i] = (d <= radius) & (cos > 0) ? w : 0;
+    }
+}
+
+void shadow_texels(const ShadowMap& map, const ShadeBatch& batch, const Vec3& loc, int* __restrict x,
+        int* __restrict y) {
+    int w = map.w, h = map.h, n = batch.count;
+    if (map.layout == SHMAP_CUBE) {
+        // as ShadowMap::pixel(): major axis picks the face, then a divide
+        for (int i = 0; i < n; i++) {
+            double dx = batch.pos[0][i] - loc.x, dy = batch.pos[1][i] - loc.y, dz = batch.pos[2][i] - loc.z;
+            double ax = std::abs(dx), ay = std::abs(dy), az = std::abs(dz);
+            bool xa = (ax >= ay) & (ax >= az), ya = !xa & (ay >= az);
+            double c = xa ? dx : (ya ? dy : dz);
+            double u = xa ? dy : (ya ? dz : dx);
+            double v = xa ? dz : (ya ? dx : dy);
+            double inv = 0.5 / std::abs(c);
+            int face = (xa ? 0 : (ya ? 2 : 4)) + (c < 0);
+            x[i] = texel((u*inv + 0.5) * h, h-1) + face*h;
+            y[i] = texel((v*inv + 0.5) * h, h-1);
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        double dx = batch.pos[0][i] - loc.x, dy = batch.pos[1][i] - loc.y, dz = batch.pos[2][i] - loc.z;
+        double tilt = atan2_pos(-dz, std::sqrt(dx*dx + dy*dy));
+        double pan = atan2_pos(dx, dy);
+        y[i] = texel((tilt/PI + 0.5) * h, h-1);
+        x[i] = texel((pan/PI/2 + 0.5) * w, w-1);
+    }
+}
+
+
+}  // namespace KERNEL_ISA
+}  // namespace Shadowmap
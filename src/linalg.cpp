@@ -94,6 +94,19 @@ double Vec3::angle(const Vec3& v) const {
 }
 
 
+void invert(const double m[3][3], double inv[3][3]) {
+    double det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+        - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+        + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int i1 = (j+1) % 3, i2 = (j+2) % 3, j1 = (i+1) % 3, j2 = (i+2) % 3;
+            inv[i][j] = (m[i1][j1]*m[i2][j2] - m[i1][j2]*m[i2][j1]) / det;
+        }
+    }
+}
+
+
 Ray::Ray(double x, double y, double z, double dx, double dy, double dz) {
     pt = Vec3(x, y, z);
     dir = Vec3(dx, dy, dz);
@@ -17,12 +17,24 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "shadowmap.hpp"
 
 
 namespace Shadowmap {
 
 
+Face::Face() {
+}
+
 Face::Face(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& normal) {
     this->p1 = p1;
     this->p2 = p2;
@@ -32,47 +44,239 @@ Face::Face(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& normal) {
 
 
 Mesh::Mesh() {
+    dirty = false;
 }
 
 Mesh::Mesh(const Vec3& loc, const Vec3& color) {
     this->loc = loc;
     this->color = color;
+    dirty = false;
 }
 
 Mesh::Mesh(const Vec3& loc, const Vec3& color, const std::string& filename) {
     this->loc = loc;
     this->color = color;
-    std::ifstream fp(filename);
-    read_stl(fp);
+    dirty = false;
+    load_stl(filename);
+}
+
+void Mesh::add_face(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& normal) {
+    int first = verts.size();
+    verts.push_back(p1);
+    verts.push_back(p2);
+    verts.push_back(p3);
+    tris.push_back(Tri{{first, first+1, first+2}});
+    normals.push_back(normal);
 }
 
-void Mesh::read_stl(std::ifstream& fp) {
-    union uint32 {
-        int i;
-        char c[4];
-    };
-    union float32 {
-        float f;
-        char c[4];
-    };
-
-    fp.seekg(80, std::ios::cur);  // skip header
-    uint32 count;
-    fp.read(count.c, 4);
-
-    for (int i = 0; i < count.i; i++) {
-        float32 data[12];   // normal(3), pt1(3), pt2(3), pt3(3)
+void Mesh::weld() {
+    // open addressing table of indices into welded, keyed by exact coordinates
+    size_t n = verts.size();
+    size_t cap = 16;
+    while (cap < 2*n)
+        cap <<= 1;
+    std::vector<int> table(cap, -1);
+    std::vector<int> remap(n);
+    std::vector<Vec3> welded;
+    welded.reserve(n);
+
+    std::vector<bool> used(n, false);
+    for (const Tri& tri: tris) {
+        for (int j = 0; j < 3; j++)
+            used[tri.v[j]] = true;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!used[i])
+            continue;
+        uint64_t bits[3];
+        memcpy(bits, &verts[i], sizeof(bits));
+        uint64_t hash = (bits[0] * 0x9e3779b97f4a7c15ULL) ^ (bits[1] * 0xc2b2ae3d27d4eb4fULL) ^ bits[2];
+        hash ^= hash >> 29;
+        hash *= 0xbf58476d1ce4e5b9ULL;
+        size_t slot = (hash ^ (hash >> 32)) & (cap-1);
+
+        while (table[slot] >= 0 && memcmp(&welded[table[slot]], &verts[i], sizeof(bits)) != 0)
+            slot = (slot+1) & (cap-1);
+        if (table[slot] < 0) {
+            table[slot] = welded.size();
+            welded.push_back(verts[i]);
+        }
+        remap[i] = table[slot];
+    }
+
+    for (Tri& tri: tris) {
+        for (int j = 0; j < 3; j++)
+            tri.v[j] = remap[tri.v[j]];
+    }
+    welded.shrink_to_fit();
+    verts.swap(welded);
+}
+
+void Mesh::clear() {
+    verts.clear();
+    tris.clear();
+    normals.clear();
+}
+
+Instance::Instance(int mesh, const Vec3& loc, const Vec3& color, double pan, double scale) {
+    this->mesh = mesh;
+    this->loc = loc;
+    this->color = color;
+
+    double c = cos(pan) * scale, s = sin(pan) * scale;
+    double m[3][3] = {{c, -s, 0}, {s, c, 0}, {0, 0, scale}};
+    memcpy(matrix, m, sizeof(matrix));
+}
+
+
+constexpr int STL_HEADER = 84;  // 80 byte header and uint32 count
+constexpr int STL_RECORD = 50;  // normal, 3 points and uint16 attribute
+constexpr int STL_CHUNK = 4096;  // records per task when decoding in parallel
+
+/**
+ * Decode binary STL records [begin, end) into triangles of mesh,
+ * which is already sized. Vertices are not welded yet.
+ */
+void decode_stl(const char* records, int begin, int end, Mesh& mesh) {
+    for (int i = begin; i < end; i++) {
+        // normal(3), pt1(3), pt2(3), pt3(3). Records are unaligned, so copy
+        // out first; the conversion loop is vectorised by the compiler.
+        float f[12];
+        memcpy(f, records + (size_t)i*STL_RECORD, sizeof(f));
+        double d[12];
         for (int j = 0; j < 12; j++)
-            fp.read(data[j].c, 4);
+            d[j] = f[j];
+
+        mesh.normals[i] = Vec3(d[0], d[1], d[2]);
+        for (int j = 0; j < 3; j++) {
+            mesh.verts[3*i + j] = Vec3(d[3*j+3], d[3*j+4], d[3*j+5]);
+            mesh.tris[i].v[j] = 3*i + j;
+        }
+    }
+}
+
+/**
+ * Parse ASCII STL. Only "normal" and "vertex" keywords are read,
+ * and every third vertex completes a face.
+ */
+bool parse_ascii_stl(const char* p, const char* end, Mesh& mesh) {
+    auto space = [](char c) {return c == ' ' || c == '\t' || c == '\n' || c == '\r';};
+    auto skip = [&]() {while (p < end && space(*p)) p++;};
+
+    Vec3 normal, pts[3];
+    int vertex = 0;
+    while (true) {
+        skip();
+        if (p >= end)
+            break;
+        const char* word = p;
+        while (p < end && !space(*p))
+            p++;
 
-        Vec3 normal(data[0].f, data[1].f, data[2].f);
-        Vec3 p1(data[3].f, data[4].f, data[5].f);
-        Vec3 p2(data[6].f, data[7].f, data[8].f);
-        Vec3 p3(data[9].f, data[10].f, data[11].f);
-        faces.push_back(Face(p1, p2, p3, normal));
+        bool is_normal = p-word == 6 && memcmp(word, "normal", 6) == 0;
+        bool is_vertex = p-word == 6 && memcmp(word, "vertex", 6) == 0;
+        if (!is_normal && !is_vertex)
+            continue;
 
-        fp.seekg(2, std::ios::cur);  // skip attribute byte count
+        double c[3];
+        for (int i = 0; i < 3; i++) {
+            skip();
+            if (p < end && *p == '+')
+                p++;
+            auto res = std::from_chars(p, end, c[i]);
+            if (res.ec != std::errc())
+                return false;
+            p = res.ptr;
+        }
+
+        if (is_normal) {
+            normal = Vec3(c[0], c[1], c[2]);
+        } else {
+            pts[vertex++] = Vec3(c[0], c[1], c[2]);
+            if (vertex == 3) {
+                mesh.add_face(pts[0], pts[1], pts[2], normal);
+                vertex = 0;
+            }
+        }
     }
+    return true;
+}
+
+/**
+ * Parse a binary or ASCII STL file in memory into mesh, which is empty.
+ * Binary records are decoded in parallel on thread_pool(), with up to threads workers.
+ */
+bool parse_stl(const char* data, size_t size, Mesh& mesh, int threads) {
+    uint32_t count = 0;
+    if (size >= STL_HEADER)
+        memcpy(&count, data + 80, 4);
+    bool fits = size >= STL_HEADER && (size - STL_HEADER) / STL_RECORD >= count;
+
+    // ASCII files start with "solid", but so do some binary ones
+    bool exact = fits && size - STL_HEADER == (size_t)count * STL_RECORD;
+    if (!exact && size >= 5 && memcmp(data, "solid", 5) == 0)
+        return parse_ascii_stl(data + 5, data + size, mesh);
+    if (!fits)
+        return false;
+
+    mesh.verts.resize(3*(size_t)count);
+    mesh.tris.resize(count);
+    mesh.normals.resize(count);
+    const char* records = data + STL_HEADER;
+    int chunks = (count + STL_CHUNK - 1) / STL_CHUNK;
+    if (chunks <= 1) {
+        decode_stl(records, 0, count, mesh);
+    } else {
+        thread_pool().run(chunks, [&](int chunk, int worker) {
+            int begin = chunk * STL_CHUNK;
+            decode_stl(records, begin, std::min(begin + STL_CHUNK, (int)count), mesh);
+        }, threads);
+    }
+    return true;
+}
+
+bool Mesh::load_stl(const std::string& filename, int threads) {
+    clear();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    bool ok = parse_stl((const char*)mapping, size, *this, threads);
+    munmap(mapping, size);
+    if (ok)
+        weld();
+    else
+        clear();
+    return ok;
+}
+
+bool Mesh::read_stl(std::ifstream& fp) {
+    clear();
+    std::string data((std::istreambuf_iterator<char>(fp)), std::istreambuf_iterator<char>());
+    bool ok = parse_stl(data.data(), data.size(), *this, 0);
+    if (ok)
+        weld();
+    else
+        clear();
+    return ok;
 }
 
 
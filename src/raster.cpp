@@ -0,0 +1,503 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+constexpr int RASTER_BAND = 8;  // shadow map rows per task
+constexpr int RASTER_CHUNK = 4096;  // triangles per bounding task
+constexpr double RASTER_EPS = 1e-9;  // barycentric slack, as in the ray kernels
+
+
+/**
+ * Texel directions of a map, the same as build_map() traces.
+ */
+struct MapDirs {
+    const ShadowMap& map;
+    std::vector<double> coord;  // cube, per column or row of a face
+    std::vector<double> pan_sin, pan_cos, tilt_sin, tilt_cos;  // equirect
+
+    MapDirs(const ShadowMap& map) : map(map) {
+        if (map.layout == SHMAP_CUBE) {
+            coord.resize(map.h);
+            for (int i = 0; i < map.h; i++)
+                coord[i] = map.direction(i, 0).y;
+            return;
+        }
+
+        for (int x = 0; x < map.w; x++) {
+            double pan = ((double)x/map.w - 0.5) * PI * 2;
+            pan_sin.push_back(sin(pan));
+            pan_cos.push_back(cos(pan));
+        }
+        for (int y = 0; y < map.h; y++) {
+            double tilt = ((double)y/map.h - 0.5) * PI;
+            tilt_sin.push_back(sin(tilt));
+            tilt_cos.push_back(cos(tilt));
+        }
+    }
+
+    Vec3 operator()(int x, int y) const {
+        if (map.layout == SHMAP_CUBE) {
+            int face = x / map.h;
+            double c[3];
+            c[face/2] = face % 2 ? -1 : 1;
+            c[(face/2 + 1) % 3] = coord[x % map.h];
+            c[(face/2 + 2) % 3] = coord[y];
+            return Vec3(c[0], c[1], c[2]);
+        }
+        return Vec3(pan_sin[x]*tilt_cos[y], pan_cos[x]*tilt_cos[y], -tilt_sin[y]);
+    }
+};
+
+
+/**
+ * Triangles of objects, then of every instance. Instance triangles are
+ * found from the leaves of their mesh's tree, so this works for scenes
+ * loaded by load_scene() too.
+ */
+std::vector<RasterItem> raster_items(const Scene& scene) {
+    std::vector<RasterItem> items;
+    for (int i = 0; i < (int)scene._tris.size(); i++) {
+        if (scene._tri_objs[i] >= 0)
+            items.push_back({i, -1});
+    }
+
+    for (int k = 0; k < (int)scene._instances.size(); k++) {
+        int stack[BVH_STACK];
+        int top = 0;
+        stack[top++] = scene._instances[k].root;
+        while (top > 0) {
+            int n = stack[--top];
+            const BVHNode& node = scene._mesh_bvh.nodes[n];
+            if (node.count == 0) {
+                stack[top++] = n + 1;
+                stack[top++] = node.first;
+                continue;
+            }
+            for (int b = node.first; b < node.first + (node.count+3) / 4; b++) {
+                for (int face: scene._mesh_bvh.blocks[b].face) {
+                    if (face >= 0)
+                        items.push_back({face, k});
+                }
+            }
+        }
+    }
+    return items;
+}
+
+/**
+ * Forward transform of every instance.
+ */
+std::vector<RasterTransform> raster_transforms(const Scene& scene) {
+    std::vector<RasterTransform> xf(scene._instances.size());
+    for (int k = 0; k < (int)xf.size(); k++) {
+        invert(scene._instances[k].inv, xf[k].m);
+        xf[k].loc = scene._instances[k].loc;
+    }
+    return xf;
+}
+
+/**
+ * Vertices of item in world space, relative to origin.
+ */
+void item_verts(const Scene& scene, const std::vector<RasterTransform>& xf, const RasterItem& item,
+        const Vec3& origin, Vec3 p[3]) {
+    const Tri& tri = scene._tris[item.tri];
+    for (int k = 0; k < 3; k++) {
+        const Vec3& v = scene._verts[tri.v[k]];
+        if (item.inst < 0) {
+            p[k] = v.sub(origin);
+            continue;
+        }
+        const double (&m)[3][3] = xf[item.inst].m;
+        Vec3 w(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+               m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+               m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+        p[k] = w.add(xf[item.inst].loc).sub(origin);
+    }
+}
+
+/**
+ * Coverage test setup of the triangle p, relative to the viewer.
+ */
+RasterTri setup_tri(const Vec3 p[3]) {
+    RasterTri tri;
+    tri.n = p[1].sub(p[0]).cross(p[2].sub(p[0]));
+    tri.bc = p[1].cross(p[2]);
+    tri.ca = p[2].cross(p[0]);
+    tri.ab = p[0].cross(p[1]);
+    tri.pn = p[0].dot(tri.n);
+    return tri;
+}
+
+/**
+ * Bounds the directions of triangle p, relative to the viewer, by tilt in
+ * [tilt0, tilt1] and pan in [pan0, pan1], with pan1 - pan0 = 2*PI if the
+ * triangle may cover a pole. Away from the poles, pan is monotonic along
+ * the edges, which are great circle arcs, and tilt peaks at a vertex or
+ * where an edge is level.
+ * Returns false if a vertex is at the viewer or the triangle is too wide,
+ * as it could wrap past a pole or the far side.
+ */
+bool bound_angles(const Vec3 p[3], double& tilt0, double& tilt1, double& pan0, double& pan1) {
+    Vec3 u[3], axis;
+    for (int k = 0; k < 3; k++) {
+        double len = p[k].magnitude();
+        if (len == 0)
+            return false;
+        u[k] = p[k].div(len);
+        axis = axis.add(u[k]);
+    }
+    if (axis.magnitude() < 1e-9)
+        return false;
+    axis = axis.unit();
+
+    // cap around the mean direction
+    double cos_r = min(axis.dot(u[0]), axis.dot(u[1]), axis.dot(u[2]));
+    if (cos_r < 0.01)
+        return false;
+    double r = acos(std::min(cos_r, 1.0));
+    double tilt = atan2(-axis.z, distance(axis.x, axis.y));
+    double pan = atan2(axis.x, axis.y);
+    if (tilt - r <= -PI/2 || tilt + r >= PI/2 || sin(r) >= cos(tilt)) {
+        tilt0 = tilt - r;
+        tilt1 = tilt + r;
+        pan0 = pan - PI;
+        pan1 = pan + PI;
+        return true;
+    }
+
+    double zmin = 1, zmax = -1;
+    pan0 = 1e300;
+    pan1 = -1e300;
+    for (int k = 0; k < 3; k++) {
+        const Vec3& a = u[k];
+        const Vec3& b = u[(k+1) % 3];
+        double rel = remainder(atan2(a.x, a.y) - pan, 2*PI);
+        pan0 = std::min(pan0, pan + rel);
+        pan1 = std::max(pan1, pan + rel);
+        zmin = std::min(zmin, a.z);
+        zmax = std::max(zmax, a.z);
+
+        // highest and lowest points of the edge's great circle, if on the edge
+        Vec3 m = a.cross(b);
+        double len = m.magnitude();
+        if (len < 1e-12)
+            continue;
+        Vec3 top = Vec3(0, 0, 1).sub(m.mul(m.z / (len*len)));
+        if (top.magnitude() < 1e-12)
+            continue;
+        top = top.unit();
+        for (double sign: {1.0, -1.0}) {
+            Vec3 q = top.mul(sign);
+            if (a.cross(q).dot(m) >= 0 && q.cross(b).dot(m) >= 0) {
+                zmin = std::min(zmin, q.z);
+                zmax = std::max(zmax, q.z);
+            }
+        }
+    }
+
+    // margin for rounding
+    tilt0 = -asin(dbounds(zmax, -1, 1)) - 1e-9;
+    tilt1 = -asin(dbounds(zmin, -1, 1)) + 1e-9;
+    pan0 -= 1e-9;
+    pan1 += 1e-9;
+    return true;
+}
+
+/**
+ * Appends rects of an equirect map's texels that the triangle p, relative
+ * to the light, may cover, split in two where the triangle crosses the
+ * seam at pan = +-PI.
+ */
+void bound_equirect(const ShadowMap& map, int item, const Vec3 p[3], std::vector<RasterRect>& rects) {
+    RasterRect all = {item, 0, map.w-1, 0, map.h-1};
+    double tilt0, tilt1, pan0, pan1;
+    if (!bound_angles(p, tilt0, tilt1, pan0, pan1)) {
+        rects.push_back(all);
+        return;
+    }
+
+    all.y0 = std::max((int)floor((tilt0/PI + 0.5) * map.h) - 1, 0);
+    all.y1 = std::min((int)ceil((tilt1/PI + 0.5) * map.h) + 1, map.h-1);
+    int x0 = (int)floor((pan0/PI/2 + 0.5) * map.w) - 1;
+    int x1 = (int)ceil((pan1/PI/2 + 0.5) * map.w) + 1;
+    if (x1 - x0 + 1 >= map.w) {
+        rects.push_back(all);
+        return;
+    }
+
+    int start = (x0 % map.w + map.w) % map.w;
+    int end = start + x1 - x0;
+    if (end < map.w) {
+        rects.push_back({item, start, end, all.y0, all.y1});
+    } else {
+        rects.push_back({item, start, map.w-1, all.y0, all.y1});
+        rects.push_back({item, 0, end - map.w, all.y0, all.y1});
+    }
+}
+
+/**
+ * Appends rects of a cube map's texels that the triangle p, relative to
+ * the light, may cover: per face, the part in front of the light is
+ * projected onto the face.
+ */
+void bound_cube(const ShadowMap& map, int item, const Vec3 p[3], std::vector<RasterRect>& rects) {
+    double eps = 1e-9 * std::max(std::max(p[0].magnitude(), p[1].magnitude()), p[2].magnitude());
+
+    for (int face = 0; face < 6; face++) {
+        int a = face / 2, a1 = (a+1) % 3, a2 = (a+2) % 3;
+        double s = face % 2 ? -1 : 1;
+
+        // clip to the half space in front of the face
+        double poly[4][3];
+        int n = 0;
+        for (int k = 0; k < 3; k++) {
+            const Vec3& c = p[k];
+            const Vec3& d = p[(k+1) % 3];
+            double pc[3] = {c.x, c.y, c.z}, pd[3] = {d.x, d.y, d.z};
+            double dc = s*pc[a] - eps, dd = s*pd[a] - eps;
+            if (dc >= 0) {
+                for (int i = 0; i < 3; i++)
+                    poly[n][i] = pc[i];
+                n++;
+            }
+            if ((dc >= 0) != (dd >= 0)) {
+                double f = dc / (dc - dd);
+                for (int i = 0; i < 3; i++)
+                    poly[n][i] = pc[i] + (pd[i] - pc[i]) * f;
+                n++;
+            }
+        }
+        if (n == 0)
+            continue;
+
+        double umin = 1e300, umax = -1e300, vmin = 1e300, vmax = -1e300;
+        for (int k = 0; k < n; k++) {
+            double depth = std::max(s*poly[k][a], eps);
+            double u = poly[k][a1] / depth, v = poly[k][a2] / depth;
+            umin = std::min(umin, u);
+            umax = std::max(umax, u);
+            vmin = std::min(vmin, v);
+            vmax = std::max(vmax, v);
+        }
+        if (umin > 1 || umax < -1 || vmin > 1 || vmax < -1)
+            continue;
+
+        // texel i samples (i+0.5)/h*2 - 1
+        auto texel = [&](double c) {return dbounds((c+1)/2 * map.h - 0.5, -2, map.h + 1);};
+        int x0 = bounds((int)floor(texel(umin)) - 1, 0, map.h-1), x1 = bounds((int)ceil(texel(umax)) + 1, 0, map.h-1);
+        int y0 = bounds((int)floor(texel(vmin)) - 1, 0, map.h-1), y1 = bounds((int)ceil(texel(vmax)) + 1, 0, map.h-1);
+        rects.push_back({item, face*map.h + x0, face*map.h + x1, y0, y1});
+    }
+}
+
+/**
+ * Bins rects into a grid of cols x rows cells of cell_w x cell_h by
+ * counting sort, keeping their order: the rects of cell i are bins[offsets[i]]
+ * to bins[offsets[i+1]-1]. Rects are copied, so each cell's are contiguous.
+ */
+void bin_rects(const std::vector<RasterRect>& rects, int cell_w, int cell_h, int cols, int rows,
+        std::vector<int>& offsets, std::vector<RasterRect>& bins) {
+    offsets.assign(cols*rows + 1, 0);
+    for (const RasterRect& r: rects) {
+        for (int y = r.y0 / cell_h; y <= r.y1 / cell_h; y++) {
+            for (int x = r.x0 / cell_w; x <= r.x1 / cell_w; x++)
+                offsets[y*cols + x + 1]++;
+        }
+    }
+    for (int i = 0; i < cols*rows; i++)
+        offsets[i+1] += offsets[i];
+
+    bins.resize(offsets[cols*rows]);
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for (const RasterRect& r: rects) {
+        for (int y = r.y0 / cell_h; y <= r.y1 / cell_h; y++) {
+            for (int x = r.x0 / cell_w; x <= r.x1 / cell_w; x++)
+                bins[fill[y*cols + x]++] = r;
+        }
+    }
+}
+
+/**
+ * Lower bound of the distance from the viewer to triangle p: the larger of
+ * its plane's distance, and the nearest vertex's less the longest edge.
+ */
+double near_dist(const Vec3 p[3]) {
+    Vec3 n = p[1].sub(p[0]).cross(p[2].sub(p[0]));
+    double plane = n.magnitude() > 0 ? std::abs(p[0].dot(n)) / n.magnitude() : 0;
+    double edge = std::max(std::max(p[1].sub(p[0]).magnitude(), p[2].sub(p[1]).magnitude()),
+        p[0].sub(p[2]).magnitude());
+    double vert = min(p[0].magnitude(), p[1].magnitude(), p[2].magnitude());
+    return std::max(plane, vert - edge);
+}
+
+/**
+ * Rects of every item as seen from origin, bounded on the thread pool and
+ * sorted front to back by near.
+ */
+template <class Bound>
+std::vector<RasterRect> bound_items(const Scene& scene, const std::vector<RasterItem>& items,
+        const std::vector<RasterTransform>& xf, const Vec3& origin, const Bound& bound) {
+    int chunks = (items.size() + RASTER_CHUNK - 1) / RASTER_CHUNK;
+    std::vector<std::vector<RasterRect>> chunk_rects(chunks);
+    thread_pool().run(chunks, [&](int c, int worker) {
+        int end = std::min((c+1) * RASTER_CHUNK, (int)items.size());
+        for (int k = c * RASTER_CHUNK; k < end; k++) {
+            Vec3 p[3];
+            item_verts(scene, xf, items[k], origin, p);
+            std::vector<RasterRect>& out = chunk_rects[c];
+            size_t first = out.size();
+            bound(k, p, out);
+            double near = near_dist(p);
+            for (size_t r = first; r < out.size(); r++)
+                out[r].near = near;
+        }
+    }, scene.threads);
+
+    std::vector<RasterRect> rects;
+    for (const std::vector<RasterRect>& part: chunk_rects)
+        rects.insert(rects.end(), part.begin(), part.end());
+    std::sort(rects.begin(), rects.end(), [](const RasterRect& a, const RasterRect& b) {return a.near < b.near;});
+    return rects;
+}
+
+/**
+ * Rasterizes rects[0] to rects[count-1] into layers of
+ * [x0, x1) x [y0, y1), keeping the nearest distance along dirs(x, y, layer)
+ * in depth, layer then row major, which starts at 1e9. setup(item) gives
+ * each item's RasterTri. Rects must be sorted by near: once every depth is
+ * nearer than a rect, the rest are hidden and skipped.
+ * @param nearest if not null, set to the item of each depth, or -1
+ */
+template <class Setup, class Dirs>
+void raster_rects(const RasterRect* rects, int count, const Setup& setup,
+        int x0, int y0, int x1, int y1, int layers, const Dirs& dirs, double* depth, int* nearest) {
+    int w = x1 - x0, size = w * (y1-y0);
+    uint64_t tests = 0;
+    int uncovered = layers * size;  // depths still 1e9
+    double far = 1e9;  // at least the farthest depth
+
+    for (int i = 0; i < count; i++) {
+        const RasterRect& rect = rects[i];
+        if (rect.near > far) {
+            far = *std::max_element(depth, depth + layers*size);
+            if (rect.near > far)
+                break;
+        }
+        const RasterTri& tri = setup(rect.item);
+        const Vec3 &n = tri.n, &bc = tri.bc, &ca = tri.ca, &ab = tri.ab;
+        double pn = tri.pn;
+
+        int rx0 = std::max(rect.x0, x0), rx1 = std::min(rect.x1, x1-1);
+        for (int y = std::max(rect.y0, y0); y <= std::min(rect.y1, y1-1); y++) {
+            tests += std::max(rx1 - rx0 + 1, 0) * layers;
+            for (int x = rx0; x <= rx1; x++) {
+                for (int layer = 0; layer < layers; layer++) {
+                    // the weights over d.n are at least -RASTER_EPS, without dividing
+                    Vec3 d = dirs(x, y, layer);
+                    double dn = d.dot(n);
+                    if (std::abs(dn) <= 1e-300)
+                        continue;
+                    double sign = dn > 0 ? 1 : -1, slack = -RASTER_EPS * std::abs(dn);
+                    if (pn*sign <= -slack || d.dot(bc)*sign < slack || d.dot(ca)*sign < slack
+                            || d.dot(ab)*sign < slack)
+                        continue;
+
+                    double dist = pn / dn * d.magnitude();
+                    int j = layer*size + (y-y0)*w + (x-x0);
+                    if (dist < depth[j]) {
+                        if (depth[j] >= 1e9 && --uncovered == 0)
+                            far = *std::max_element(depth, depth + layers*size);
+                        depth[j] = dist;
+                        if (nearest)
+                            nearest[j] = rect.item;
+                    }
+                }
+            }
+        }
+    }
+    _count(STAT_FACE_TESTS, tests);
+}
+
+
+void raster_maps(Scene& scene, const std::vector<int>& todo, const std::vector<std::vector<Cone>>* cones,
+        bool verbose) {
+    if (todo.empty())
+        return;
+
+    std::vector<RasterItem> items = raster_items(scene);
+    std::vector<RasterTransform> xf = raster_transforms(scene);
+
+    for (int j = 0; j < (int)todo.size(); j++) {
+        double start = time_ms();
+        int i = todo[j];
+        ShadowMap& map = scene.shadow_maps[i];
+        const Light& light = scene.lights[i];
+        MapDirs dirs(map);
+
+        std::vector<RasterRect> rects = bound_items(scene, items, xf, light.loc,
+            [&](int item, const Vec3 p[3], std::vector<RasterRect>& out) {
+                if (map.layout == SHMAP_CUBE)
+                    bound_cube(map, item, p, out);
+                else
+                    bound_equirect(map, item, p, out);
+            });
+
+        int bands = (map.h + RASTER_BAND - 1) / RASTER_BAND;
+        std::vector<int> offsets;
+        std::vector<RasterRect> bins;
+        bin_rects(rects, map.w, RASTER_BAND, 1, bands, offsets, bins);
+
+        thread_pool().run(bands, [&](int b, int worker) {
+            int y0 = b * RASTER_BAND, y1 = std::min(y0 + RASTER_BAND, map.h);
+            std::vector<double> depth((size_t)(y1-y0) * map.w, 1e9);
+            auto setup = [&](int item) {
+                Vec3 p[3];
+                item_verts(scene, xf, items[item], light.loc, p);
+                return setup_tri(p);
+            };
+            raster_rects(bins.data() + offsets[b], offsets[b+1] - offsets[b], setup, 0, y0, map.w, y1, 1,
+                [&](int x, int y, int layer) {return dirs(x, y);}, depth.data(), nullptr);
+
+            const std::vector<Cone>* light_cones = cones ? &(*cones)[j] : nullptr;
+            for (int y = y0; y < y1; y++) {
+                for (int x = 0; x < map.w; x++) {
+                    if (light_cones == nullptr || in_cones(*light_cones, dirs(x, y)))
+                        map.set(x, y, depth[(size_t)(y-y0) * map.w + x]);
+                }
+            }
+        }, scene.threads);
+
+        record_phase(cones ? "partial_shadow_map" : "shadow_map", i, start);
+        if (verbose)
+            std::cerr << "\rShadow maps: " << (j+1) * 100 / todo.size() << "%" << std::flush;
+    }
+}
+
+
+}  // namespace Shadowmap
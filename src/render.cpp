@@ -18,6 +18,7 @@
 //
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iostream>
 #include "shadowmap.hpp"
@@ -26,104 +27,420 @@
 namespace Shadowmap {
 
 
+constexpr int RENDER_TILE = 16;  // tile size in pixels
+constexpr double SHADOW_BIAS = 0.1;  // depth a surface may be behind its map and still be lit
+constexpr double VSM_MIN_VARIANCE = 1e-4;  // against acne on flat receivers
+constexpr double VSM_BLEED = 0.2;  // visibility below this reads as 0, against light bleeding
+
 /**
- * Read a pixel of the shadow map given the XYZ point.
- * Delta values are relative to the light.
- * Delta values are unit vector.
+ * Fraction of the light reaching a point delta from it, d_real away, by
+ * Chebyshev's bound on the depths around it in the prefiltered map.
  */
-double read_shadow_map(Scene& scene, ShadowMap& map, Vec3 delta) {
-    double tilt = atan2(-delta.z, distance(delta.x, delta.y));
-    double pan = atan2(delta.x, delta.y);
-    int y = (tilt/PI + 0.5) * scene.SHMAP_H;
-    int x = (pan/PI/2 + 0.5) * scene.SHMAP_W;
-
-    x = bounds(x, 0, scene.SHMAP_W-1);
-    y = bounds(y, 0, scene.SHMAP_H-1);
-    return map.get(x, y);
+double read_vsm(Scene& scene, ShadowMap& map, const Vec3& delta, double d_real) {
+    double mean, sqmean;
+    map.filtered(delta, scene.SHMAP_PENUMBRA, mean, sqmean);
+    double d = d_real - SHADOW_BIAS;
+    if (d <= mean)
+        return 1;
+
+    double var = std::max(sqmean - mean*mean, VSM_MIN_VARIANCE);
+    double p = var / (var + (d-mean)*(d-mean));
+    return dbounds((p - VSM_BLEED) / (1 - VSM_BLEED), 0, 1);
 }
 
 /**
- * Returns the color of rendered pixel.
+ * Direction of the camera ray through continuous pixel coordinates (x, y),
+ * e.g. (10.5, 3.5) is the center of pixel (10, 3).
  */
-Vec3 render_px(Scene& scene, Image& img, int x, int y) {
+Vec3 camera_dir(Scene& scene, Image& img, double x, double y) {
     double fov_x = scene.fov / 360;
     double fov_y = fov_x * img.h / img.w;
-    double tilt = ((double)y/img.h - 0.5) * 2*PI * fov_y + scene.cam_tilt;
-    double pan = ((double)x/img.w - 0.5) * 2*PI * fov_x + scene.cam_pan;
-
-    // add randomness to tilt and pan
-    tilt += randd() * fov_y / img.h;
-    pan += randd() * fov_x / img.w;
+    double tilt = (y/img.h - 0.5) * 2*PI * fov_y + scene.cam_tilt;
+    double pan = (x/img.w - 0.5) * 2*PI * fov_x + scene.cam_pan;
 
-    // find closest object in current pixel
     Vec3 delta(sin(pan)*cos(tilt), cos(pan)*cos(tilt), -sin(tilt));
-    Ray ray(scene.cam_loc, delta.unit());
-    Intersect inter = intersect(scene._faces, ray);
-    if (inter.dist >= 1e9-10)
-        return scene.bg;
-
-    const Vec3& hit = inter.pos;
-    const Vec3& normal = inter.normal;
-
-    // compute lighting
-    Vec3 v = scene.bg;
-    for (int i = 0; i < (int)scene.lights.size(); i++) {
-        // see if this light hits the object
-        Light& light = scene.lights[i];
-        Vec3 delta = hit.sub(light.loc);
-        double d_map = read_shadow_map(scene, scene.shadow_maps[i], delta);
-        double d_real = delta.magnitude();
-        if (d_real-d_map > 0.1)
+    return delta.unit();
+}
+
+/**
+ * Colors of the closest objects found by a packet of camera rays. Hits
+ * are shaded together, one light at a time, with the shading kernels.
+ */
+void shade_packet(Scene& scene, const Intersect* inters, int count, Vec3* colors) {
+    ShadeBatch batch;
+    int lanes[PACKET_SIZE];  // batch point to packet ray
+    batch.count = 0;
+    for (int k = 0; k < count; k++) {
+        colors[k] = scene.bg;
+        if (inters[k].dist >= 1e9-10)
             continue;
+        int j = batch.count++;
+        lanes[j] = k;
+        const Intersect& inter = inters[k];
+        batch.pos[0][j] = inter.pos.x, batch.pos[1][j] = inter.pos.y, batch.pos[2][j] = inter.pos.z;
+        batch.normal[0][j] = inter.normal.x, batch.normal[1][j] = inter.normal.y, batch.normal[2][j] = inter.normal.z;
+    }
+    if (batch.count == 0)
+        return;
 
-        // inverse square falloff
-        double fac_dist = 1 / pow(d_real, 2);
+    // lights that may reach some hit: all, or those whose sphere of influence holds one
+    int lights = scene.lights.size();
+    bool culling = scene._light_radii.size() == scene.lights.size() && lights > 0;
+    thread_local std::vector<int> near, candidates;
+    candidates.clear();
+    if (culling) {
+        thread_local std::vector<char> seen;
+        seen.assign(lights, 0);
+        for (int j = 0; j < batch.count; j++) {
+            near.clear();
+            lights_at(scene, inters[lanes[j]].pos, near);
+            _count(STAT_LIGHTS_CULLED, lights - near.size());
+            for (int i: near) {
+                if (!seen[i])
+                    candidates.push_back(i);
+                seen[i] = 1;
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+    } else {
+        for (int i = 0; i < lights; i++)
+            candidates.push_back(i);
+    }
 
-        // dim by dot of normal and light vector
-        Vec3 light_ray = light.loc.sub(hit).unit();
-        double fac_norm = light_ray.dot(normal);
-        fac_norm = std::max(fac_norm, 0.0);
+    Vec3 sum[PACKET_SIZE];
+    alignas(64) double dist[PACKET_SIZE], weight[PACKET_SIZE];
+    alignas(64) int tx[PACKET_SIZE], ty[PACKET_SIZE];
+    uint64_t lookups = 0;
+    for (int i: candidates) {
+        Light& light = scene.lights[i];
+        ShadowMap& map = scene.shadow_maps[i];
+        light_weights(batch, light.loc, light.power, culling ? scene._light_radii[i] : INFINITY, dist, weight);
+        if (map._moments == nullptr)
+            shadow_texels(map, batch, light.loc, tx, ty);
 
-        double power = light.power * fac_dist * fac_norm;
-        v = v.add(light.color.mul(inter.color).mul(power));
+        for (int j = 0; j < batch.count; j++) {
+            if (weight[j] <= 0)
+                continue;
+            double visible;
+            if (map._moments != nullptr)
+                visible = read_vsm(scene, map, inters[lanes[j]].pos.sub(light.loc), dist[j]);
+            else
+                visible = dist[j] - map.get(tx[j], ty[j]) > SHADOW_BIAS ? 0 : 1;
+            lookups++;
+            sum[j] = sum[j].add(light.color.mul(weight[j] * visible));
+        }
     }
+    _count(STAT_SHADOW_LOOKUPS, lookups);
 
-    v.x = dbounds(v.x, 0, 1);
-    v.y = dbounds(v.y, 0, 1);
-    v.z = dbounds(v.z, 0, 1);
-    return v;
+    for (int j = 0; j < batch.count; j++) {
+        Vec3 v = scene.bg.add(sum[j].mul(inters[lanes[j]].color));
+        v.x = dbounds(v.x, 0, 1);
+        v.y = dbounds(v.y, 0, 1);
+        v.z = dbounds(v.z, 0, 1);
+        colors[lanes[j]] = v;
+    }
 }
 
-void render(Scene& scene, Image& img, int samples, bool verbose) {
-    int start = time();
+/**
+ * Luminance of a linear rgb color.
+ */
+inline double luminance(const Vec3& c) {
+    return 0.2126*c.x + 0.7152*c.y + 0.0722*c.z;
+}
 
-    build_faces(scene, scene.cam_loc);
+/**
+ * Receives the result of a pixel: sum of sample colors and sample count.
+ */
+typedef std::function<void(int x, int y, const Vec3& sum, int count)> PixelSink;
 
-    int last_percent = -1;  // for verbose
-    for (int y = 0; y < img.h; y++) {
-        for (int x = 0; x < img.w; x++) {
-            if (verbose) {
-                int percent = (y*img.w + x) * 100 / (img.w*img.h);
-                if (percent != last_percent) {
-                    std::cerr << "\rRendering: " << percent << "%" << std::flush;
-                    last_percent = percent;
-                }
+/**
+ * Writes the average of a pixel's samples to img.
+ */
+void write_px(Image& img, int x, int y, const Vec3& sum, int count) {
+    Vec3 avg = sum.div(count);
+    Vec3 v = avg.mul(255);
+    img.set(x, y, 0, v.x);
+    img.set(x, y, 1, v.y);
+    img.set(x, y, 2, v.z);
+
+    if (img.hdr != nullptr) {
+        float* px = img.hdr + 3*(y*img.w + x);
+        px[0] = avg.x;
+        px[1] = avg.y;
+        px[2] = avg.z;
+    }
+}
+
+/**
+ * Scramble of a pixel's sample sequence, seeded by pixel and frame.
+ */
+inline void pixel_scramble(Scene& scene, Image& img, int x, int y, uint32_t scramble[2]) {
+    Rng rng(scene.frame, (uint64_t)y*img.w + x);
+    scramble[0] = rng.next();
+    scramble[1] = rng.next();
+}
+
+/**
+ * Renders pixels [x0, x1) x [y0, y1), at most PACKET_SIZE of them,
+ * tracing the primary rays of each sample as one packet.
+ * Takes min_samples per pixel, then keeps adding batches of min_samples
+ * to pixels whose standard error of luminance is above threshold,
+ * up to max_samples. Samples are numbered from first in each pixel's
+ * sequence. Calls sink with each pixel's sum of colors and sample count.
+ * Returns the number of samples taken.
+ */
+int render_packet(Scene& scene, Image& img, int first, int min_samples, int max_samples, double threshold,
+        int x0, int y0, int x1, int y1, const PixelSink& sink) {
+    int size = (x1-x0) * (y1-y0);
+    RayPacket packet;
+    packet.pt = scene.cam_loc;
+
+    uint32_t scramble[PACKET_SIZE][2];
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++)
+            pixel_scramble(scene, img, x, y, scramble[(y-y0)*(x1-x0) + (x-x0)]);
+    }
+
+    Vec3 sum[PACKET_SIZE];
+    double sqsum[PACKET_SIZE] = {0};  // of luminance
+    int count[PACKET_SIZE] = {0};
+    int active[PACKET_SIZE];  // pixels that need more samples
+    int rays[PACKET_SIZE];  // packet ray to pixel
+    Intersect inters[PACKET_SIZE];
+    Vec3 colors[PACKET_SIZE];
+
+    while (true) {
+        int actives = 0;
+        for (int j = 0; j < size; j++) {
+            int n = count[j];
+            if (n >= max_samples)
+                continue;
+            if (n >= min_samples) {
+                double mean = luminance(sum[j]) / n;
+                double var = std::max(sqsum[j]/n - mean*mean, 0.0) / (n-1);
+                if (var / n <= threshold*threshold)
+                    continue;
+            }
+            active[actives++] = j;
+        }
+        if (actives == 0)
+            break;
+
+        for (int i = 0; i < min_samples; i++) {
+            // the last batch of a pixel stops at max_samples
+            packet.size = 0;
+            for (int k = 0; k < actives; k++) {
+                if (count[active[k]] + i < max_samples)
+                    rays[packet.size++] = active[k];
             }
+            if (packet.size == 0)
+                break;
 
-            Vec3 sum;
-            for (int i = 0; i < samples; i++)
-                sum = sum.add(render_px(scene, img, x, y));
-            sum = sum.div(samples).mul(255);
+            for (int k = 0; k < packet.size; k++) {
+                int j = rays[k];
+                double u, v;
+                sample_2d(first + count[j] + i, scramble[j][0], scramble[j][1], u, v);
+                packet.dir[k] = camera_dir(scene, img, x0 + j%(x1-x0) + u, y0 + j/(x1-x0) + v);
+            }
 
-            img.set(x, y, 0, sum.x);
-            img.set(x, y, 1, sum.y);
-            img.set(x, y, 2, sum.z);
+            intersect_packet(scene, packet, inters);
+            shade_packet(scene, inters, packet.size, colors);
+            for (int k = 0; k < packet.size; k++) {
+                const Vec3& c = colors[k];
+                sum[rays[k]] = sum[rays[k]].add(c);
+                sqsum[rays[k]] += luminance(c) * luminance(c);
+            }
         }
+        for (int k = 0; k < actives; k++)
+            count[active[k]] = std::min(count[active[k]] + min_samples, max_samples);
     }
 
+    int total = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            int j = (y-y0)*(x1-x0) + (x-x0);
+            sink(x, y, sum[j], count[j]);
+            total += count[j];
+        }
+    }
+    return total;
+}
+
+/**
+ * Renders all tiles of img on the thread pool with render_packet().
+ * Tiles not started by *deadline (milliseconds from time_ms()) are skipped.
+ * Rows of tiles are written to writer, if not null, in order as they finish.
+ * Returns the number of samples taken.
+ */
+long long render_tiles(Scene& scene, Image& img, int first, int min_samples, int max_samples, double threshold,
+        const double* deadline, bool verbose, ImageWriter* writer, const PixelSink& sink) {
+    int tiles_x = (img.w + RENDER_TILE - 1) / RENDER_TILE;
+    int tiles_y = (img.h + RENDER_TILE - 1) / RENDER_TILE;
+    int tiles = tiles_x * tiles_y;
+    double start = time_ms();
+
+    std::atomic<int> done(0);
+    std::atomic<long long> total(0);
+    std::mutex print_lock;
+    int last_percent = -1;  // for verbose
+
+    // tiles left per row of tiles, and the next row to write
+    std::vector<std::atomic<int>> row_left(tiles_y);
+    for (std::atomic<int>& left: row_left)
+        left = tiles_x;
+    std::mutex write_lock;
+    int next_row = 0;
+    auto write_rows = [&]() {
+        while (next_row < tiles_y && row_left[next_row] == 0) {
+            int y0 = next_row * RENDER_TILE;
+            writer->write_rows(img, y0, std::min(y0 + RENDER_TILE, img.h));
+            next_row++;
+        }
+    };
+
+    thread_pool().run(tiles, [&](int tile, int worker) {
+        if (deadline && time_ms() >= *deadline)
+            return;
+
+        int x0 = tile % tiles_x * RENDER_TILE, y0 = tile / tiles_x * RENDER_TILE;
+        int x1 = std::min(x0 + RENDER_TILE, img.w), y1 = std::min(y0 + RENDER_TILE, img.h);
+
+        for (int py = y0; py < y1; py += PACKET_W) {
+            for (int px = x0; px < x1; px += PACKET_W) {
+                total += render_packet(scene, img, first, min_samples, max_samples, threshold,
+                    px, py, std::min(px+PACKET_W, x1), std::min(py+PACKET_W, y1), sink);
+            }
+        }
+
+        // a busy writer picks up finished rows when done, so don't wait for it
+        if (writer && --row_left[tile / tiles_x] == 0) {
+            std::unique_lock<std::mutex> lock(write_lock, std::try_to_lock);
+            if (lock.owns_lock())
+                write_rows();
+        }
+
+        if (verbose) {
+            int percent = ++done * 100 / tiles;
+            std::lock_guard<std::mutex> lock(print_lock);
+            if (percent > last_percent) {
+                std::cerr << "\rRendering: " << percent << "%" << std::flush;
+                last_percent = percent;
+            }
+        }
+    }, scene.threads);
+
+    if (writer)
+        write_rows();
+    record_phase("render", -1, start);
+    return total;
+}
+
+/**
+ * Renders img and prints timing if verbose.
+ */
+void render_image(Scene& scene, Image& img, int min_samples, int max_samples, double threshold, bool verbose,
+        ImageWriter* writer) {
+    int start = time();
+
+    long long total = render_tiles(scene, img, 0, min_samples, max_samples, threshold, nullptr, verbose, writer,
+        [&](int x, int y, const Vec3& sum, int count) {write_px(img, x, y, sum, count);});
+
     if (verbose) {
         double elapse = (time() - start) / 1000.0;
-        std::cerr << "\rRender finished in " << elapse << " seconds" << std::endl;
+        std::cerr << "\rRender finished in " << elapse << " seconds, "
+            << (double)total / (img.w*img.h) << " samples per pixel" << std::endl;
+    }
+}
+
+void render(Scene& scene, Image& img, int samples, bool verbose, ImageWriter* writer) {
+    render_image(scene, img, samples, samples, 0, verbose, writer);
+}
+
+void render_adaptive(Scene& scene, Image& img, int min_samples, int max_samples, double threshold, bool verbose,
+        ImageWriter* writer) {
+    render_image(scene, img, std::max(min_samples, 2), std::max(max_samples, 2), threshold, verbose, writer);
+}
+
+int render_progressive(Scene& scene, Image& img, int pass_samples, int max_passes, double time_limit,
+        double target_error, const std::function<bool(Image&, int)>& callback, bool verbose) {
+    double start = time_ms();
+    double deadline = start + time_limit * 1000;
+
+    // running sums per pixel, and of each pass's mean luminance for the error estimate
+    int n = img.w * img.h;
+    std::vector<float> accum(3*n, 0);
+    std::vector<float> lum_sum(n, 0), lum_sqsum(n, 0);
+    std::vector<int> samples(n, 0), passes(n, 0);
+
+    int pass = 0;
+    while (pass < max_passes) {
+        render_tiles(scene, img, pass * pass_samples, pass_samples, pass_samples, 0,
+            time_limit > 0 && pass > 0 ? &deadline : nullptr, false, nullptr,
+            [&](int x, int y, const Vec3& sum, int count) {
+                int i = y*img.w + x;
+                accum[3*i] += sum.x;
+                accum[3*i+1] += sum.y;
+                accum[3*i+2] += sum.z;
+                samples[i] += count;
+                passes[i]++;
+
+                double lum = luminance(sum) / count;
+                lum_sum[i] += lum;
+                lum_sqsum[i] += lum * lum;
+
+                write_px(img, x, y, Vec3(accum[3*i], accum[3*i+1], accum[3*i+2]), samples[i]);
+            });
+        pass++;
+
+        // mean over pixels of the standard error of the pixel's value
+        double error = 0;
+        for (int i = 0; i < n; i++) {
+            int p = passes[i];
+            if (p < 2) {
+                error = 1e9;
+                break;
+            }
+            double mean = lum_sum[i] / p;
+            double var = std::max(lum_sqsum[i]/p - mean*mean, 0.0) / (p-1);
+            error += sqrt(var / p) / n;
+        }
+
+        if (verbose) {
+            double elapse = (time_ms() - start) / 1000;
+            std::cerr << "\rPass " << pass << ", " << elapse << " seconds";
+            if (error < 1e9)
+                std::cerr << ", error " << error;
+            std::cerr << std::flush;
+        }
+
+        if (callback && !callback(img, pass))
+            break;
+        if (time_limit > 0 && time_ms() >= deadline)
+            break;
+        if (target_error > 0 && error <= target_error)
+            break;
+    }
+
+    if (verbose)
+        std::cerr << std::endl;
+    return pass;
+}
+
+void render_sequence(Scene& scene, Image& img, int frames, int samples,
+        const std::function<void(Scene&, int)>& update, const std::function<void(Image&, int)>& output,
+        bool verbose) {
+    for (int frame = 0; frame < frames; frame++) {
+        scene.frame = frame;
+        if (update)
+            update(scene, frame);
+
+        if (verbose)
+            std::cerr << "Frame " << frame+1 << " of " << frames << std::endl;
+        rebuild(scene, verbose);
+        render(scene, img, samples, verbose);
+
+        if (output)
+            output(img, frame);
     }
 }
 
@@ -18,6 +18,7 @@
 //
 
 #include <cmath>
+#include <sys/mman.h>
 #include "shadowmap.hpp"
 
 
@@ -55,11 +56,28 @@ Scene::Scene(double cam_x, double cam_y, double cam_z, double pan, double tilt,
 Scene::~Scene() {
     for (ShadowMap& map: shadow_maps)
         map.free();
+    if (_mapping != nullptr)
+        munmap(_mapping, _mapping_size);
 }
 
 void Scene::_init() {
     SHMAP_W = 1024;
     SHMAP_H = 1024;
+    SHMAP_BUDGET = 0;
+    SHMAP_LAYOUT = SHMAP_EQUIRECT;
+    SHMAP_PRECISION = SHMAP_DOUBLE;
+    SHMAP_TILED = false;
+    SHMAP_BUILDER = SHMAP_RAYTRACE;
+    SHMAP_FILTER = SHMAP_HARD;
+    SHMAP_PENUMBRA = 2;
+    threads = 0;
+    cam_aspect = 0.75;
+    frame = 0;
+    light_cutoff = 0;
+
+    _compiled = false;
+    _mapping = nullptr;
+    _mapping_size = 0;
 }
 
 void Scene::add_light(double x, double y, double z, double power, const Vec3& color) {
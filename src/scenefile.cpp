@@ -0,0 +1,282 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+constexpr char SCENE_MAGIC[8] = "SHMAPS";
+constexpr uint32_t SCENE_VERSION = 3;
+
+/**
+ * Arrays stored in a scene file, in file order.
+ */
+enum SceneSection {
+    SEC_VERTS, SEC_TRIS, SEC_NORMALS, SEC_TRI_OBJS, SEC_COLORS,
+    SEC_NODES, SEC_INDICES, SEC_BLOCKS, SEC_MESH_NODES, SEC_MESH_INDICES, SEC_MESH_BLOCKS,
+    SEC_TLAS_NODES, SEC_TLAS_INDICES, SEC_INSTANCES, SEC_COUNT
+};
+
+/**
+ * Header of a scene file. Each array follows at a 64 byte aligned offset.
+ * Element sizes are stored so files from an incompatible build are rejected.
+ */
+struct SceneHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sizes[SEC_COUNT];  // bytes per element
+    uint64_t counts[SEC_COUNT];
+    uint64_t offsets[SEC_COUNT];
+};
+
+static_assert(std::is_standard_layout<Vec3>::value, "Vec3 is written as raw bytes");
+
+
+/**
+ * Round up to a multiple of 64.
+ */
+inline uint64_t align64(uint64_t v) {
+    return (v + 63) & ~(uint64_t)63;
+}
+
+/**
+ * Write size bytes at offset, padding the file with zeros up to it.
+ * Returns false if the stream failed.
+ */
+bool write_at(std::ofstream& fp, uint64_t offset, const void* data, size_t size) {
+    static const char zeros[64] = {0};
+    std::streamoff pos = fp.tellp();
+    if (pos == -1 || (uint64_t)pos > offset)
+        return false;
+    fp.write(zeros, offset - pos);
+    fp.write((const char*)data, size);
+    return (bool)fp;
+}
+
+/**
+ * The scene's arrays by section, as (data, element size, count) for saving
+ * or as buffers to view for loading.
+ */
+struct Sections {
+    const void* data[SEC_COUNT];
+    uint32_t sizes[SEC_COUNT];
+    uint64_t counts[SEC_COUNT];
+
+    template <typename T>
+    void set(SceneSection sec, const Buffer<T>& buf) {
+        data[sec] = buf.data();
+        sizes[sec] = sizeof(T);
+        counts[sec] = buf.size();
+    }
+
+    Sections(const Scene& scene) {
+        set(SEC_VERTS, scene._verts);
+        set(SEC_TRIS, scene._tris);
+        set(SEC_NORMALS, scene._normals);
+        set(SEC_TRI_OBJS, scene._tri_objs);
+        set(SEC_COLORS, scene._colors);
+        set(SEC_NODES, scene._bvh.nodes);
+        set(SEC_INDICES, scene._bvh.indices);
+        set(SEC_BLOCKS, scene._bvh.blocks);
+        set(SEC_MESH_NODES, scene._mesh_bvh.nodes);
+        set(SEC_MESH_INDICES, scene._mesh_bvh.indices);
+        set(SEC_MESH_BLOCKS, scene._mesh_bvh.blocks);
+        set(SEC_TLAS_NODES, scene._tlas.nodes);
+        set(SEC_TLAS_INDICES, scene._tlas.indices);
+        set(SEC_INSTANCES, scene._instances);
+    }
+};
+
+/**
+ * Point buf at its section of a mapped scene file.
+ */
+template <typename T>
+void view_section(Buffer<T>& buf, char* base, const SceneHeader& h, SceneSection sec) {
+    buf.view((T*)(base + h.offsets[sec]), h.counts[sec]);
+}
+
+/**
+ * Elements of section sec of a mapped scene file.
+ */
+template <typename T>
+const T* section(const char* base, const SceneHeader& h, SceneSection sec) {
+    return (const T*)(base + h.offsets[sec]);
+}
+
+/**
+ * True if the nodes of a tree reference only what exists: children after
+ * their parent, so there are no cycles, and within the nodes; leaves
+ * within items, blocks of 4 faces if blocks, else indices; and no node
+ * deeper than BVH_MAX_DEPTH, so traversal stacks hold.
+ */
+bool valid_nodes(const BVHNode* nodes, uint64_t count, uint64_t items, bool blocks) {
+    std::vector<int> depth(count, 0);
+    for (uint64_t i = 0; i < count; i++) {
+        const BVHNode& node = nodes[i];
+        if (depth[i] > BVH_MAX_DEPTH || node.first < 0 || node.count < 0)
+            return false;
+        if (node.count > 0) {
+            uint64_t used = blocks ? ((uint64_t)node.count + 3) / 4 : node.count;
+            if ((uint64_t)node.first + used > items)
+                return false;
+            continue;
+        }
+        if (i+1 >= count || (uint64_t)node.first <= i || (uint64_t)node.first >= count)
+            return false;
+        depth[i+1] = std::max(depth[i+1], depth[i] + 1);
+        depth[node.first] = std::max(depth[node.first], depth[i] + 1);
+    }
+    return true;
+}
+
+/**
+ * True if every index stored in a mapped scene file, of vertices, faces,
+ * colors, nodes, blocks and instances, is within its array.
+ */
+bool valid_scene(const char* base, const SceneHeader& h) {
+    const uint64_t* n = h.counts;
+    const Tri* tris = section<Tri>(base, h, SEC_TRIS);
+    for (uint64_t i = 0; i < n[SEC_TRIS]; i++) {
+        for (int v: tris[i].v) {
+            if (v < 0 || (uint64_t)v >= n[SEC_VERTS])
+                return false;
+        }
+    }
+
+    if (n[SEC_NORMALS] != n[SEC_TRIS] || n[SEC_TRI_OBJS] != n[SEC_TRIS])
+        return false;
+    const int* objs = section<int>(base, h, SEC_TRI_OBJS);
+    for (uint64_t i = 0; i < n[SEC_TRI_OBJS]; i++) {
+        if (objs[i] < -1 || (objs[i] >= 0 && (uint64_t)objs[i] >= n[SEC_COLORS]))
+            return false;
+    }
+
+    for (SceneSection sec: {SEC_BLOCKS, SEC_MESH_BLOCKS}) {
+        const TriBlock* blocks = section<TriBlock>(base, h, sec);
+        for (uint64_t i = 0; i < n[sec]; i++) {
+            for (int face: blocks[i].face) {
+                if (face < -1 || (face >= 0 && (uint64_t)face >= n[SEC_TRIS]))
+                    return false;
+            }
+        }
+    }
+    const int* insts = section<int>(base, h, SEC_TLAS_INDICES);
+    for (uint64_t i = 0; i < n[SEC_TLAS_INDICES]; i++) {
+        if (insts[i] < 0 || (uint64_t)insts[i] >= n[SEC_INSTANCES])
+            return false;
+    }
+    const InstanceData* data = section<InstanceData>(base, h, SEC_INSTANCES);
+    for (uint64_t i = 0; i < n[SEC_INSTANCES]; i++) {
+        if (data[i].root < 0 || (uint64_t)data[i].root >= n[SEC_MESH_NODES])
+            return false;
+    }
+
+    return valid_nodes(section<BVHNode>(base, h, SEC_NODES), n[SEC_NODES], n[SEC_BLOCKS], true)
+        && valid_nodes(section<BVHNode>(base, h, SEC_MESH_NODES), n[SEC_MESH_NODES], n[SEC_MESH_BLOCKS], true)
+        && valid_nodes(section<BVHNode>(base, h, SEC_TLAS_NODES), n[SEC_TLAS_NODES], n[SEC_TLAS_INDICES], false);
+}
+
+bool save_scene(const Scene& scene, const std::string& filename) {
+    Sections secs(scene);
+
+    SceneHeader header = {};
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    uint64_t offset = align64(sizeof(SceneHeader));
+    for (int i = 0; i < SEC_COUNT; i++) {
+        header.sizes[i] = secs.sizes[i];
+        header.counts[i] = secs.counts[i];
+        header.offsets[i] = offset;
+        offset = align64(offset + header.counts[i]*header.sizes[i]);
+    }
+
+    std::ofstream fp(filename, std::ios::binary);
+    bool ok = write_at(fp, 0, &header, sizeof(header));
+    for (int i = 0; ok && i < SEC_COUNT; i++)
+        ok = write_at(fp, header.offsets[i], secs.data[i], header.counts[i]*header.sizes[i]);
+    fp.close();
+
+    return ok && (bool)fp;
+}
+
+bool load_scene(Scene& scene, const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SceneHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // private writable mapping: clean pages are shared, writes are copy on write
+    size_t size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const SceneHeader& h = *(const SceneHeader*)mapping;
+    Sections expected(scene);
+    bool valid = memcmp(h.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) == 0 && h.version == SCENE_VERSION;
+    for (int i = 0; valid && i < SEC_COUNT; i++) {
+        valid = h.sizes[i] == expected.sizes[i] && h.offsets[i] % 64 == 0 && h.offsets[i] <= size
+            && h.counts[i] <= (size - h.offsets[i]) / h.sizes[i];
+    }
+    if (!valid || !valid_scene((const char*)mapping, h)) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    char* base = (char*)mapping;
+    view_section(scene._verts, base, h, SEC_VERTS);
+    view_section(scene._tris, base, h, SEC_TRIS);
+    view_section(scene._normals, base, h, SEC_NORMALS);
+    view_section(scene._tri_objs, base, h, SEC_TRI_OBJS);
+    view_section(scene._colors, base, h, SEC_COLORS);
+    view_section(scene._bvh.nodes, base, h, SEC_NODES);
+    view_section(scene._bvh.indices, base, h, SEC_INDICES);
+    view_section(scene._bvh.blocks, base, h, SEC_BLOCKS);
+    view_section(scene._mesh_bvh.nodes, base, h, SEC_MESH_NODES);
+    view_section(scene._mesh_bvh.indices, base, h, SEC_MESH_INDICES);
+    view_section(scene._mesh_bvh.blocks, base, h, SEC_MESH_BLOCKS);
+    view_section(scene._tlas.nodes, base, h, SEC_TLAS_NODES);
+    view_section(scene._tlas.indices, base, h, SEC_TLAS_INDICES);
+    view_section(scene._instances, base, h, SEC_INSTANCES);
+
+    if (scene._mapping != nullptr)
+        munmap(scene._mapping, scene._mapping_size);
+    scene._mapping = mapping;
+    scene._mapping_size = size;
+    scene._compiled = true;
+    return true;
+}
+
+
+}  // namespace Shadowmap
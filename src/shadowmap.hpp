@@ -19,8 +19,16 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 
@@ -32,17 +40,70 @@ typedef  unsigned char  UCH;
 constexpr double PI = 3.14159;
 
 
+/**
+ * Array that either owns its elements, or views memory owned by someone
+ * else such as a mapped file. Changing the size of a view copies it first.
+ */
+template <typename T>
+struct Buffer {
+    std::vector<T> _vec;
+    T* _view = nullptr;  // null if owning
+    size_t _view_size = 0;
+
+    /**
+     * View size elements at ptr instead of owning.
+     */
+    void view(T* ptr, size_t size) {
+        _vec.clear();
+        _vec.shrink_to_fit();
+        _view = ptr;
+        _view_size = size;
+    }
+
+    /**
+     * Copy a view into owned memory.
+     */
+    void own() {
+        if (_view != nullptr) {
+            _vec.assign(_view, _view + _view_size);
+            _view = nullptr;
+            _view_size = 0;
+        }
+    }
+
+    T* data() { return _view != nullptr ? _view : _vec.data(); }
+    const T* data() const { return _view != nullptr ? _view : _vec.data(); }
+    size_t size() const { return _view != nullptr ? _view_size : _vec.size(); }
+    bool empty() const { return size() == 0; }
+
+    T& operator[](size_t i) { return data()[i]; }
+    const T& operator[](size_t i) const { return data()[i]; }
+
+    T* begin() { return data(); }
+    T* end() { return data() + size(); }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+
+    void push_back(const T& v) { own(); _vec.push_back(v); }
+    void reserve(size_t n) { own(); _vec.reserve(n); }
+    void resize(size_t n) { own(); _vec.resize(n); }
+    void clear() { _view = nullptr; _view_size = 0; _vec.clear(); }
+};
+
+
 /**
  * RGB unsigned char image.
  */
 struct Image {
     int w, h;
     UCH* data;
+    float* hdr;  // rgb before quantizing, 0 to 1, or null
 
     /**
      * Initialize with width and height.
+     * @param hdr also keep float values, for PFM output
      */
-    Image(int width, int height);
+    Image(int width, int height, bool hdr = false);
 
     /**
      * Free data.
@@ -60,39 +121,188 @@ struct Image {
     void set(int x, int y, int chn, UCH value);
 
     /**
-     * Write image to file.
+     * Write image to file in the raw format.
      * Use scripts/convert.py to convert to other formats.
      */
     void write(std::ofstream& fp);
+
+    /**
+     * Write image to a file, in PNG, PPM or PFM format by the file's
+     * extension, else raw. Returns false on errors.
+     */
+    bool save(const std::string& filename);
+};
+
+/**
+ * Image file formats. Raw is the format of Image::write().
+ */
+enum ImageFormat {
+    IMAGE_RAW,
+    IMAGE_PPM,
+    IMAGE_PNG,
+    IMAGE_PFM,
+};
+
+struct Deflater;
+
+/**
+ * Writes an image file a few rows at a time, so rows can be saved as
+ * soon as they are rendered.
+ * PNG is compressed with a built-in deflate, PFM is written from
+ * Image::hdr when the image has it.
+ */
+struct ImageWriter {
+    int w, h;
+    ImageFormat format;
+
+    /**
+     * Open filename, with the format given by its extension.
+     */
+    ImageWriter(const std::string& filename, int w, int h);
+
+    ImageWriter(const std::string& filename, int w, int h, ImageFormat format);
+
+    /**
+     * Closes the file.
+     */
+    ~ImageWriter();
+
+    /**
+     * Write rows [y0, y1) of img. Rows must be written in order from the top.
+     * Returns false on errors.
+     */
+    bool write_rows(const Image& img, int y0, int y1);
+
+    /**
+     * Finish the file. Returns false on errors or if rows are missing.
+     */
+    bool close();
+
+    std::ofstream _fp;
+    int _next;  // next row to write
+    bool _closed;
+    size_t _header;  // PFM header size
+    std::unique_ptr<Deflater> _deflate;  // PNG
+    std::vector<uint8_t> _prev;  // PNG, previous row for filtering
+
+    void _chunk(const char* type, const std::vector<uint8_t>& data);
 };
 
+struct Vec3;
+
+
 /**
- * Grayscale double image.
+ * Parameterisation of directions around a light in a ShadowMap.
+ */
+enum ShadowLayout {
+    SHMAP_EQUIRECT,  // pan along x, tilt along y
+    SHMAP_CUBE,      // six h*h faces side by side: +x, -x, +y, -y, +z, -z
+};
+
+/**
+ * Storage type of ShadowMap pixels.
+ */
+enum ShadowPrecision {
+    SHMAP_DOUBLE,  // 8 bytes
+    SHMAP_FLOAT,   // 4 bytes
+    SHMAP_U16,     // 2 bytes, normalised to [depth_min, depth_max]
+};
+
+/**
+ * How build() fills shadow maps. Both store the distance to the nearest
+ * hit along each texel's direction.
+ */
+enum ShadowBuilder {
+    SHMAP_RAYTRACE,  // one ray per texel through the BVH
+    SHMAP_RASTER,    // each triangle projected onto the texels it covers
+};
+
+/**
+ * How render() reads shadow maps.
+ */
+enum ShadowFilter {
+    SHMAP_HARD,  // the texel's depth, lit or not
+    SHMAP_VSM,   // variance shadow map: soft visibility from the mean and variance of depth around the texel
+};
+
+/**
+ * Grayscale depth image.
  * No automatic deallocation. Use map.free() to free memory.
  */
 struct ShadowMap {
     int w, h;
-    double* data;
+    ShadowLayout layout;
+    ShadowPrecision precision;
+    bool tiled;  // 8x8 tiles with Morton order inside, else row major
+    double depth_min, depth_max;  // SHMAP_U16 range, larger values read as 1e9. build() fits depth_min to the nearest depth
+    void* data;
+
+    void* _mapping;  // file mapping holding data if loaded from cache, else null
+    size_t _mapping_size;
+    double* _moments;  // used internally, summed-area tables of depth and depth^2 from prefilter(), or null
 
     /**
      * Initialize with width and height.
      */
-    ShadowMap(int width, int height);
+    ShadowMap(int width, int height, ShadowLayout layout = SHMAP_EQUIRECT,
+        ShadowPrecision precision = SHMAP_DOUBLE, bool tiled = false);
 
     /**
-     * Free data.
+     * Free data, or unmap it if loaded from cache, and the moments.
      */
     void free();
 
+    /**
+     * Copy data loaded from cache into memory of its own, so it can be
+     * written with set(). Does nothing if not loaded from cache.
+     */
+    void own();
+
+    /**
+     * Index of pixel (x, y) in data.
+     */
+    int index(int x, int y) const;
+
+    /**
+     * Bytes of data.
+     */
+    size_t bytes() const;
+
     /**
      * Get pixel value.
      */
-    double get(int x, int y);
+    double get(int x, int y) const;
 
     /**
      * Set pixel value.
+     * SHMAP_U16 rounds up, so stored depths never shadow the surface itself.
      */
     void set(int x, int y, double value);
+
+    /**
+     * Direction from the light through pixel (x, y). Not unit length.
+     */
+    Vec3 direction(int x, int y) const;
+
+    /**
+     * Pixel containing direction dir from the light.
+     * For SHMAP_CUBE this is a major axis select and a divide.
+     */
+    void pixel(const Vec3& dir, int& x, int& y) const;
+
+    /**
+     * Builds summed-area tables of depth and depth^2 for filtered(),
+     * 16 bytes per texel. Misses count as a depth beyond every hit.
+     * Call again after changing data.
+     */
+    void prefilter();
+
+    /**
+     * Mean depth and mean depth^2 over texels within radius of the one
+     * containing dir, in constant time. Boxes are clipped to the map, and
+     * for SHMAP_CUBE to the face. Needs prefilter().
+     */
+    void filtered(const Vec3& dir, int radius, double& mean, double& sqmean) const;
 };
 
 
@@ -146,6 +356,11 @@ struct Vec3 {
     double angle(const Vec3& v) const;
 };
 
+/**
+ * Inverse of the 3x3 matrix m, by cofactors.
+ */
+void invert(const double m[3][3], double inv[3][3]);
+
 /**
  * Vector with starting point.
  */
@@ -159,6 +374,10 @@ struct Ray {
 };
 
 
+/**
+ * Triangle with its own copy of its vertices, for the linear intersect().
+ * Meshes and scenes store indexed triangles instead.
+ */
 struct Face {
     Vec3 p1, p2, p3;
     Vec3 normal;
@@ -169,16 +388,30 @@ struct Face {
     double _angle;  // used internally
     double _min_dist;  // used internally
 
+    Face();
+
     Face(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& normal);
 };
 
 /**
- * Mesh object. Can read binary STL file.
+ * Triangle of an indexed mesh.
+ */
+struct Tri {
+    int v[3];  // indices into the mesh's vertices
+};
+
+/**
+ * Mesh object. Can read binary and ASCII STL files.
+ * Triangles index into a shared vertex array, so vertices used by several
+ * triangles are stored once.
  */
 struct Mesh {
     Vec3 loc;  // location
     Vec3 color;  // rgb, 0 to 1
-    std::vector<Face> faces;
+    std::vector<Vec3> verts;
+    std::vector<Tri> tris;
+    std::vector<Vec3> normals;  // per triangle
+    bool dirty;  // set after editing geometry in place, cleared by build() and rebuild()
 
     Mesh();
 
@@ -187,9 +420,108 @@ struct Mesh {
     Mesh(const Vec3& loc, const Vec3& color, const std::string& filename);
 
     /**
-     * Clears faces and reads from file.
+     * Append a triangle with its own three vertices. Call weld() after
+     * adding faces to share vertices between them.
+     */
+    void add_face(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& normal);
+
+    /**
+     * Merge vertices with identical coordinates and drop unused ones.
+     */
+    void weld();
+
+    /**
+     * Removes all triangles and vertices.
+     */
+    void clear();
+
+    /**
+     * Clears the mesh and reads from file, welding vertices.
+     * Returns false, leaving the mesh empty, if the file is invalid.
+     */
+    bool read_stl(std::ifstream& fp);
+
+    /**
+     * Clears the mesh and reads an STL file by mapping it into memory.
+     * Binary files are decoded in parallel on thread_pool(), with up to threads workers.
+     * Returns false, leaving the mesh empty, if the file is missing or invalid,
+     * e.g. shorter than its triangle count says.
+     */
+    bool load_stl(const std::string& filename, int threads = 0);
+};
+
+/**
+ * Mesh placed in the scene with its own transform and color.
+ * All instances of a mesh share its geometry and BVH.
+ */
+struct Instance {
+    int mesh;  // index into Scene.meshes
+    Vec3 loc;  // location of the mesh's origin
+    Vec3 color;  // rgb, 0 to 1
+    double matrix[3][3];  // rotation and scale from mesh to world, row major
+
+    /**
+     * Instance rotated by pan radians about z and scaled uniformly.
      */
-    void read_stl(std::ifstream& fp);
+    Instance(int mesh, const Vec3& loc, const Vec3& color, double pan = 0, double scale = 1);
+};
+
+/**
+ * Node of a flattened bounding volume hierarchy.
+ * Nodes are stored depth first, so the left child of an interior
+ * node is always the next node in the array.
+ */
+struct BVHNode {
+    Vec3 bmin, bmax;  // bounding box
+    int first;  // leaf: first block in BVH.blocks. interior: right child
+    int count;  // leaf: number of faces. interior: 0
+};
+
+/**
+ * Four triangles in structure of arrays layout, tested at once by
+ * intersect_block(). Unused lanes have zero edges and never hit.
+ */
+struct alignas(32) TriBlock {
+    double p1[3][4];  // first vertex, [axis][lane]
+    double e1[3][4];  // p2 - p1
+    double e2[3][4];  // p3 - p1
+    int face[4];  // index into Scene._tris, -1 if unused
+};
+
+constexpr int BVH_MAX_DEPTH = 64;  // nodes this deep are leaves, whatever their size
+constexpr int BVH_STACK = BVH_MAX_DEPTH + 1;  // traversal stack entries enough for any tree
+
+/**
+ * Bounding volume hierarchy over Scene._tris.
+ * Built with the surface area heuristic.
+ */
+struct BVH {
+    Buffer<BVHNode> nodes;
+    Buffer<int> indices;  // face indices, contiguous per leaf
+    Buffer<TriBlock> blocks;  // leaf faces, ceil(count/4) blocks per leaf
+};
+
+/**
+ * Instance as traced, with the inverse of its transform.
+ */
+struct InstanceData {
+    double inv[3][3];  // world to mesh, row major
+    Vec3 loc;
+    Vec3 color;
+    int root;  // of the mesh's tree in Scene._mesh_bvh
+};
+
+constexpr int PACKET_W = 8;
+constexpr int PACKET_SIZE = PACKET_W * PACKET_W;
+
+/**
+ * Up to PACKET_SIZE rays with a common origin, e.g. camera rays of
+ * neighbouring pixels.
+ */
+struct RayPacket {
+    Vec3 pt;  // common starting point
+    Vec3 dir[PACKET_SIZE];
+    int size;
 };
 
 /**
@@ -206,29 +538,131 @@ struct Light {
 };
 
 
+/**
+ * Fixed size pool of worker threads.
+ * Each worker has its own task queue; idle workers steal from the others,
+ * so a few slow tasks don't leave the rest of the pool waiting.
+ */
+struct ThreadPool {
+    /**
+     * Creates threads-1 workers. The thread calling run() is worker 0.
+     */
+    ThreadPool(int threads);
+
+    /**
+     * Stops and joins workers.
+     */
+    ~ThreadPool();
+
+    int size() const;
+
+    /**
+     * Calls fn(task, worker) for every task in [0, count) and waits for all.
+     * Tasks are dealt to workers in contiguous chunks. Uses the first
+     * threads workers, 0 for all. Not reentrant.
+     */
+    void run(int count, const std::function<void(int, int)>& fn, int threads = 0);
+
+    std::vector<std::thread> _threads;
+    std::vector<std::deque<int>> _queues;
+    std::vector<std::mutex> _locks;  // one per queue
+    std::mutex _mutex;
+    std::condition_variable _wake, _done;
+    const std::function<void(int, int)>* _fn;
+    int _pending;
+    std::atomic<int> _active;  // workers of the current run
+    int _generation;
+    bool _stop;
+
+    /**
+     * Pop own task from front, or steal from back of another queue.
+     */
+    bool _take(int worker, int& task);
+
+    void _work(int worker);
+
+    void _loop(int worker);
+};
+
+/**
+ * Shared thread pool with a worker per core, created on first use.
+ * Callers limit their threads with run().
+ */
+ThreadPool& thread_pool();
+
+
+/**
+ * Mesh as it was when the scene's geometry was last built from it.
+ * Used internally by rebuild() to find what changed.
+ */
+struct BuiltMesh {
+    Vec3 loc, color;
+    const Vec3* verts;  // Mesh.verts.data()
+    const Tri* tris;  // Mesh.tris.data()
+    int vert_count, count;
+    int first_vert;  // index of the first vertex in Scene._verts
+    int first;  // index of the first triangle in Scene._tris
+};
+
+
 /**
  * Collection of things to render.
  * Also camera parameters.
  */
 struct Scene {
     std::vector<Mesh> objs;
+    std::vector<Mesh> meshes;  // geometry shared by instances, loc and color are unused
+    std::vector<Instance> instances;
     std::vector<Light> lights;
     std::vector<ShadowMap> shadow_maps;
     int SHMAP_W, SHMAP_H;
+    size_t SHMAP_BUDGET;  // bytes for all maps, sized per light by its importance to the camera view; 0 for all at SHMAP_W*SHMAP_H
+    ShadowLayout SHMAP_LAYOUT;  // cube maps use about SHMAP_W*SHMAP_H texels
+    ShadowPrecision SHMAP_PRECISION;
+    bool SHMAP_TILED;
+    ShadowBuilder SHMAP_BUILDER;
+    ShadowFilter SHMAP_FILTER;  // takes effect at build() or rebuild()
+    int SHMAP_PENUMBRA;  // SHMAP_VSM filter radius in texels, wider is softer
+    std::string SHMAP_CACHE;  // directory to cache shadow maps in, empty to disable
+    int threads;  // worker threads for build and render, at most one per core, 0 for all cores
 
     Vec3 cam_loc;
     double cam_pan, cam_tilt;  // radians. (0, 0) faces +y
     double fov;   // FOV in degrees of X (horizontal) of camera.
+    double cam_aspect;  // height over width of the rendered images, for the view SHMAP_BUDGET weighs lights over. 0.75 by default
     Vec3 bg;  // background color, 0 to 1
-
-    std::vector<Face> _faces;  // used internally
+    int frame;  // seeds the per pixel random numbers
+    double light_cutoff;  // skip lights contributing less than this to a point, 0 to shade with all. Skipped lights add up where many overlap. Takes effect at build() or rebuild()
+
+    // geometry of all objects in world space, then of all meshes in mesh
+    // space, used internally. Only _verts and _tris are read while
+    // building; the rest only for shading hits.
+    Buffer<Vec3> _verts;
+    Buffer<Tri> _tris;  // indices into _verts
+    Buffer<Vec3> _normals;  // per triangle
+    Buffer<int> _tri_objs;  // per triangle, index into _colors, -1 for meshes
+    Buffer<Vec3> _colors;  // per object
+    BVH _bvh;  // used internally, over the objects' triangles
+    BVH _mesh_bvh;  // used internally, one tree per mesh, concatenated
+    BVH _tlas;  // used internally, over _instances, indices are instances
+    BVH _light_bvh;  // used internally, over lights' spheres of influence, indices are lights
+    std::vector<double> _light_radii;  // used internally, per light, empty if not culling
+    Buffer<InstanceData> _instances;  // used internally
+    bool _compiled;  // geometry and _bvh loaded by load_scene()
+    void* _mapping;  // file mapped by load_scene(), or null
+    size_t _mapping_size;
+    std::vector<BuiltMesh> _built_objs;  // used internally
+    std::vector<BuiltMesh> _built_meshes;  // used internally, first and first_vert are in mesh space
+    std::vector<Instance> _built_instances;  // used internally
+    std::vector<int> _mesh_roots;  // used internally, root of each mesh's tree in _mesh_bvh
+    std::vector<Vec3> _built_lights;  // used internally, light locations of shadow_maps
 
     Scene();
 
     Scene(double cam_x, double cam_y, double cam_z, double pan, double tilt, double fov);
 
     /**
-     * Frees shadow maps.
+     * Frees shadow maps and unmaps a loaded scene file.
      */
     ~Scene();
 
@@ -252,7 +686,7 @@ double distance(double dx, double dy);
 
 double distance(double dx, double dy, double dz);
 
-double distance(Vec3& v1, Vec3& v2);
+double distance(const Vec3& v1, const Vec3& v2);
 
 /**
  * Clamp value to range.
@@ -269,9 +703,37 @@ bool sign(double v);
 
 /**
  * Random from 0 to 1
+ * Uses a per-thread generator, so safe to call concurrently.
  */
 double randd();
 
+/**
+ * PCG32 random number generator.
+ * Small and cheap to seed, so each pixel can have its own.
+ */
+struct Rng {
+    uint64_t state, inc;
+
+    /**
+     * Generators with different streams are independent.
+     */
+    Rng(uint64_t seed, uint64_t stream);
+
+    uint32_t next();
+
+    /**
+     * Random from 0 to 1, excluding 1.
+     */
+    double nextd();
+};
+
+/**
+ * Sample i of a stratified 2D sequence in [0, 1)^2.
+ * First two dimensions of Sobol, scrambled by XOR with scramble_u and
+ * scramble_v, so any power of two consecutive samples are stratified.
+ */
+void sample_2d(uint32_t i, uint32_t scramble_u, uint32_t scramble_v, double& u, double& v);
+
 /**
  * Milliseconds since epoch.
  */
@@ -288,10 +750,82 @@ struct Intersect {
     Vec3 color;   // color of the face at intersection
 };
 
+/**
+ * Intersect a single face with the infinite line through ray.
+ * Sets pt to the intersection point and returns true if there is one.
+ */
+bool intersect_face(const Face& f, const Ray& ray, Vec3& pt);
+
+/**
+ * Moller-Trumbore test of a ray against the four triangles of a block.
+ * Ignores hits at or behind pt, and at or beyond tmax.
+ *
+ * @param t set to distance of the closest hit in units of dir
+ * @return lane of the closest hit, or -1
+ */
+int intersect_block(const TriBlock& block, const Vec3& pt, const Vec3& dir, double tmax, double& t);
+
+typedef int (*IntersectBlocksFn)(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax);
+
+/**
+ * Kernels in use, used internally. Starts as a function picking them.
+ */
+extern std::atomic<IntersectBlocksFn> _intersect_blocks;
+
+/**
+ * Closest hit of a ray with count consecutive blocks before tmax, with
+ * the kernels of kernel_isa(). Lowers tmax to the hit.
+ * @return 4*block + lane of the hit, or -1
+ */
+inline int intersect_blocks(const TriBlock* blocks, int count, const Vec3& pt, const Vec3& dir, double& tmax) {
+    return _intersect_blocks.load(std::memory_order_relaxed)(blocks, count, pt, dir, tmax);
+}
+
+/**
+ * Points shaded together, e.g. the camera hits of a packet, in structure
+ * of arrays layout for the shading kernels.
+ */
+struct alignas(64) ShadeBatch {
+    double pos[3][PACKET_SIZE];  // [axis][point]
+    double normal[3][PACKET_SIZE];
+    int count;
+};
+
+/**
+ * Light reaching each point of batch from a light at loc, unshadowed:
+ * power times the cosine at the surface over the squared distance, or 0
+ * if facing away or farther than radius. Sets dist to the distance from
+ * the light. Uses the kernels of kernel_isa().
+ */
+void light_weights(const ShadeBatch& batch, const Vec3& loc, double power, double radius, double* dist,
+    double* weight);
+
+/**
+ * Texels of map holding each point of batch, seen from a light at loc,
+ * as ShadowMap::pixel() gives them. SHMAP_EQUIRECT angles are within a few
+ * ulp, so a point on a texel edge may land in the texel next to it.
+ * Uses the kernels of kernel_isa().
+ */
+void shadow_texels(const ShadowMap& map, const ShadeBatch& batch, const Vec3& loc, int* x, int* y);
+
+/**
+ * Instruction set of the intersection and shading kernels: "avx512", "avx2", "sse4.1"
+ * or "scalar". The best the CPU supports is picked on first use, unless
+ * the SHADOWMAP_ISA environment variable names another supported one.
+ */
+std::string kernel_isa();
+
+/**
+ * Switch kernels to isa, or "auto" for the best supported.
+ * Returns false, changing nothing, if unknown or not supported.
+ */
+bool set_kernel_isa(const std::string& isa);
+
 /**
  * Intersect faces with a ray.
  * If no intersection, distance is arbitrarily large number.
  * Else, smallest distance.
+ * Linear scan over all faces; see intersect(Scene&, Ray&) for the fast path.
  *
  * @param faces sorted by Face._min_dist
  * @param faces build_faces() call with respect to ray.pt
@@ -299,21 +833,338 @@ struct Intersect {
 Intersect intersect(std::vector<Face>& faces, Ray& ray);
 
 /**
- * Build faces with respect to a point.
- * Used internally.
+ * Intersect the scene with a ray using Scene._bvh.
+ * Same semantics as intersect(faces, ray), only hits in front of ray.pt.
+ * Safe to call concurrently after build_bvh().
+ */
+Intersect intersect(const Scene& scene, const Ray& ray);
+
+/**
+ * Intersect the scene with every ray of a packet, same results as
+ * intersect(scene, ray) per ray. Nodes are culled for the whole packet
+ * with interval arithmetic on the ray directions; packets whose
+ * directions differ in sign on an axis fall back to single rays.
+ *
+ * @param ret array of packet.size results
  */
-void build_faces(Scene& scene, Vec3& pt);
+void intersect_packet(const Scene& scene, const RayPacket& packet, Intersect* ret);
+
+/**
+ * Faces of the scene's objects, not instances, prepared for
+ * intersect(faces, ray) with respect to a point.
+ */
+std::vector<Face> build_faces(const Scene& scene, const Vec3& pt);
+
+/**
+ * Hash of the geometry in Scene._verts and Scene._tris.
+ * Used internally for the shadow map cache.
+ */
+uint64_t hash_faces(const Scene& scene);
+
+/**
+ * Cache key of the shadow map of a light, from the geometry hash, the
+ * light's location and the map's size and storage.
+ */
+uint64_t shadow_map_key(uint64_t faces_hash, const Light& light, const ShadowMap& map);
+
+/**
+ * Replace map's data with a read only mapping of the cache file at path.
+ * Returns false, leaving map unchanged, if the file is missing or doesn't
+ * match key and the map's parameters.
+ */
+bool load_shadow_map(const std::string& path, uint64_t key, ShadowMap& map);
+
+/**
+ * Write map to the cache file at path. Failures are ignored.
+ */
+void save_shadow_map(const std::string& path, uint64_t key, const ShadowMap& map);
+
+/**
+ * Build Scene._bvh over the objects' triangles and a tree per mesh in
+ * Scene._mesh_bvh.
+ * Used internally, called from build().
+ */
+void build_bvh(Scene& scene);
+
+/**
+ * Build Scene._instances and Scene._tlas from Scene.instances,
+ * after build_bvh().
+ * Used internally, called from build() and rebuild().
+ */
+void build_instances(Scene& scene);
+
+/**
+ * World space bounding box of an instance, after build_bvh().
+ * Returns false if its mesh doesn't exist or is empty.
+ */
+bool instance_bounds(const Scene& scene, const Instance& inst, Vec3& bmin, Vec3& bmax);
+
+/**
+ * Bounding box of everything in the scene, objects and instances.
+ * Returns false if the scene is empty.
+ */
+bool scene_bounds(const Scene& scene, Vec3& bmin, Vec3& bmax);
+
+/**
+ * Build Scene._light_bvh over each light's sphere of influence, the
+ * distance past which its inverse square falloff puts it under
+ * Scene.light_cutoff. Clears it if light_cutoff is 0.
+ * Used internally, called from build() and rebuild().
+ */
+void build_lights(Scene& scene);
+
+/**
+ * Append the lights whose sphere of influence contains pt to lights.
+ */
+void lights_at(const Scene& scene, const Vec3& pt, std::vector<int>& lights);
+
+/**
+ * Recompute the bounds of Scene._bvh and repack its blocks after
+ * vertices moved in Scene._verts, keeping the tree's structure.
+ * Used internally, called from rebuild().
+ */
+void refit_bvh(Scene& scene);
+
+/**
+ * Cone of directions from a light, around geometry that changed.
+ * rebuild() retraces only the texels of shadow maps inside these.
+ */
+struct Cone {
+    Vec3 axis;  // unit
+    double cos_half;  // -1 if the light is inside the geometry's bounds
+};
+
+/**
+ * True if dir (any length) is inside any of cones.
+ */
+inline bool in_cones(const std::vector<Cone>& cones, const Vec3& dir) {
+    double len = dir.magnitude();
+    for (const Cone& cone: cones) {
+        if (cone.axis.dot(dir) >= cone.cos_half * len)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Fills the maps of lights in todo by rasterizing every triangle, of
+ * objects and instances, onto the texels it covers, keeping the nearest
+ * distance. Used by build() when SHMAP_BUILDER is SHMAP_RASTER.
+ * @param cones per light in todo, null to build whole maps
+ */
+void raster_maps(Scene& scene, const std::vector<int>& todo, const std::vector<std::vector<Cone>>* cones,
+    bool verbose);
+
+/**
+ * Triangle to rasterize: index in Scene._tris, and instance or -1.
+ */
+struct RasterItem {
+    int tri, inst;
+};
+
+/**
+ * Pixels or texels [x0, x1] x [y0, y1] an item may cover.
+ */
+struct RasterRect {
+    int item;
+    int x0, x1, y0, y1;
+    double near;  // at most the item's distance from the viewer
+};
+
+/**
+ * Forward transform of an instance, mesh space to world.
+ */
+struct RasterTransform {
+    double m[3][3];
+    Vec3 loc;
+};
+
+/**
+ * Triangle relative to a viewer, set up for coverage tests. A ray along d
+ * hits it at d*pn/d.n, with barycentric weights d.bc, d.ca, d.ab over d.n.
+ */
+struct RasterTri {
+    Vec3 n, bc, ca, ab;
+    double pn;
+};
+
+/**
+ * Write the preprocessed geometry and BVH of a built scene to a file.
+ * Returns false if the file can't be written.
+ */
+bool save_scene(const Scene& scene, const std::string& filename);
+
+/**
+ * Map a file written by save_scene() as the scene's geometry, without
+ * parsing or copying. Scene.objs, meshes and instances are not used by
+ * build() afterwards.
+ * Pages are shared with other processes mapping the same file.
+ * Returns false, leaving scene unchanged, if the file is missing or invalid,
+ * including any index out of range or a tree deeper than BVH_MAX_DEPTH.
+ */
+bool load_scene(Scene& scene, const std::string& filename);
 
 /**
  * Build scene.
  * Call before rendering.
+ * If Scene::SHMAP_CACHE is set, shadow maps are loaded from there when the
+ * geometry, light and map settings match, and saved there otherwise.
+ * If Scene::SHMAP_BUDGET is set, each map is SHMAP_W*SHMAP_H halved some
+ * times per side, down to 1/16, with texels about proportional to how
+ * much the light adds to a coarse grid of camera rays over the view of
+ * Scene::cam_aspect, within the budget. Maps of the least important
+ * lights get smaller than 1/16 if the budget can't hold all at that.
+ * rebuild() resizes maps whose share changes with the view.
  */
 void build(Scene& scene, bool verbose = false);
 
+/**
+ * Update a built scene after objects, lights or map settings changed.
+ * Objects are compared with their state at the last build by location,
+ * color and face vector; set Mesh.dirty after editing faces in place.
+ * Moved objects refit the BVH and retrace only the shadow map texels that
+ * could see them, before or after. Changed instances rebuild the instance
+ * tree the same way. Moved or added lights get new maps. Adding or
+ * removing objects or faces, or any change to Scene.meshes, rebuilds
+ * everything.
+ */
+void rebuild(Scene& scene, bool verbose = false);
+
 /**
  * Renders an image and stores in img.
+ * The image is split into tiles which are rendered on thread_pool() with scene.threads workers.
+ * If writer is given, each row of tiles is written to it once it and
+ * the rows above are done; call writer->close() afterwards.
+ */
+void render(Scene& scene, Image& img, int samples, bool verbose = false, ImageWriter* writer = nullptr);
+
+/**
+ * Renders an image with a variable number of samples per pixel.
+ * Every pixel gets min_samples. Pixels whose standard error of luminance
+ * (0 to 1) is still above threshold get more, in batches of min_samples,
+ * up to max_samples. Flat regions stop at min_samples.
+ */
+void render_adaptive(Scene& scene, Image& img, int min_samples, int max_samples, double threshold,
+    bool verbose = false, ImageWriter* writer = nullptr);
+
+/**
+ * Renders an image in passes of pass_samples samples per pixel, accumulated
+ * into a float buffer. After each pass img holds the average so far and
+ * callback(img, pass) is called; returning false stops rendering.
+ * Also stops after max_passes, when time_limit seconds have passed, or
+ * when the mean standard error of pixel luminance is at most target_error.
+ * Pass 0 for time_limit or target_error, or nullptr for callback,
+ * to disable them. The first pass always covers every pixel; in later
+ * passes, tiles not started by the time limit keep their earlier samples.
+ * Returns the number of passes.
+ */
+int render_progressive(Scene& scene, Image& img, int pass_samples, int max_passes, double time_limit,
+    double target_error, const std::function<bool(Image&, int)>& callback, bool verbose = false);
+
+/**
+ * Renders an animation of frames frames with samples samples per pixel.
+ * For each frame, sets Scene.frame, calls update(scene, frame) to move
+ * the camera, objects and lights, calls rebuild(), renders into img and
+ * calls output(img, frame).
+ */
+void render_sequence(Scene& scene, Image& img, int frames, int samples,
+    const std::function<void(Scene&, int)>& update, const std::function<void(Image&, int)>& output,
+    bool verbose = false);
+
+
+/**
+ * Hot path counters. Each thread counts into its own slots, which stats()
+ * sums. Define SHADOWMAP_NO_STATS when building to compile counting and
+ * phase timing out.
+ */
+enum StatCounter {
+    STAT_RAYS,            // rays traced through the BVH
+    STAT_NODES,           // BVH nodes visited
+    STAT_FACE_TESTS,      // ray-triangle tests
+    STAT_ANGLE_CULLED,    // faces skipped by the angle test of intersect(faces, ray)
+    STAT_EARLY_EXITS,     // intersect(faces, ray) loops stopped by distance
+    STAT_SHADOW_LOOKUPS,  // shadow map reads while shading
+    STAT_LIGHTS_CULLED,   // lights skipped while shading by Scene.light_cutoff
+    STAT_COUNTERS,
+};
+
+/**
+ * Wall time of one phase of build() or render(), e.g. "preprocess",
+ * "bvh", "shadow_map" or "render".
+ */
+struct PhaseTime {
+    std::string name;
+    int light;  // for shadow maps, else -1
+    double ms;  // for shadow maps, summed over threads
+};
+
+/**
+ * Counters and phase times since the last reset_stats().
+ */
+struct Stats {
+    uint64_t counters[STAT_COUNTERS];
+    std::vector<PhaseTime> phases;
+};
+
+/**
+ * Counters of one thread, used internally.
+ * Only the owning thread writes them, so relaxed loads and stores are
+ * enough and compile to plain adds.
+ */
+struct _ThreadStats {
+    std::atomic<uint64_t> counters[STAT_COUNTERS];
+
+    _ThreadStats();
+
+    /**
+     * Adds the counters to the totals of exited threads.
+     */
+    ~_ThreadStats();
+};
+
+inline void _count(StatCounter counter, uint64_t n) {
+#ifndef SHADOWMAP_NO_STATS
+    static thread_local _ThreadStats stats;
+    std::atomic<uint64_t>& c = stats.counters[counter];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#endif
+}
+
+/**
+ * Milliseconds from an arbitrary start, with sub-millisecond precision.
+ */
+double time_ms();
+
+/**
+ * Record a phase of start (from time_ms()) until now.
+ */
+void record_phase(const std::string& name, int light, double start);
+
+/**
+ * Record a phase that took ms milliseconds, measured by the caller, e.g.
+ * summed over pieces of work.
+ */
+void record_phase_ms(const std::string& name, int light, double ms);
+
+/**
+ * Counters summed over all threads, and recorded phases.
+ */
+Stats stats();
+
+/**
+ * Zero counters and forget phases.
+ */
+void reset_stats();
+
+/**
+ * Stats as a JSON object with "counters" and "phases".
+ */
+std::string stats_json(const Stats& stats);
+
+/**
+ * Write stats() as JSON to filename. Returns false on failure.
  */
-void render(Scene& scene, Image& img, int samples, bool verbose = false);
+bool save_stats(const std::string& filename);
 
 
 }  // namespace Shadowmap
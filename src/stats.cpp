@@ -0,0 +1,144 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+constexpr const char* STAT_NAMES[STAT_COUNTERS] = {
+    "rays", "nodes", "face_tests", "angle_culled", "early_exits", "shadow_lookups",
+    "lights_culled",
+};
+
+/**
+ * Live threads' counters, totals of exited threads and recorded phases.
+ * Leaked so threads exiting during static destruction can still retire.
+ */
+struct StatsRegistry {
+    std::mutex lock;
+    std::vector<_ThreadStats*> threads;
+    uint64_t retired[STAT_COUNTERS] = {0};
+    std::vector<PhaseTime> phases;
+};
+
+StatsRegistry& registry() {
+    static StatsRegistry* reg = new StatsRegistry();
+    return *reg;
+}
+
+
+_ThreadStats::_ThreadStats() {
+    for (std::atomic<uint64_t>& c: counters)
+        c.store(0, std::memory_order_relaxed);
+
+    StatsRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    reg.threads.push_back(this);
+}
+
+_ThreadStats::~_ThreadStats() {
+    StatsRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        reg.retired[i] += counters[i].load(std::memory_order_relaxed);
+    reg.threads.erase(std::find(reg.threads.begin(), reg.threads.end(), this));
+}
+
+
+double time_ms() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double, std::milli>(now).count();
+}
+
+void record_phase(const std::string& name, int light, double start) {
+    record_phase_ms(name, light, time_ms() - start);
+}
+
+void record_phase_ms(const std::string& name, int light, double ms) {
+#ifndef SHADOWMAP_NO_STATS
+    PhaseTime phase;
+    phase.name = name;
+    phase.light = light;
+    phase.ms = ms;
+
+    StatsRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    reg.phases.push_back(phase);
+#endif
+}
+
+Stats stats() {
+    Stats ret;
+    StatsRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        ret.counters[i] = reg.retired[i];
+        for (_ThreadStats* t: reg.threads)
+            ret.counters[i] += t->counters[i].load(std::memory_order_relaxed);
+    }
+    ret.phases = reg.phases;
+    return ret;
+}
+
+void reset_stats() {
+    // only owners write their slots, but a reset between runs is not racing them
+    StatsRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        reg.retired[i] = 0;
+        for (_ThreadStats* t: reg.threads)
+            t->counters[i].store(0, std::memory_order_relaxed);
+    }
+    reg.phases.clear();
+}
+
+std::string stats_json(const Stats& stats) {
+    std::string json = "{\n  \"counters\": {";
+    char buf[128];
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        snprintf(buf, sizeof(buf), "%s\n    \"%s\": %llu", i ? "," : "", STAT_NAMES[i],
+            (unsigned long long)stats.counters[i]);
+        json += buf;
+    }
+
+    json += "\n  },\n  \"phases\": [";
+    for (size_t i = 0; i < stats.phases.size(); i++) {
+        const PhaseTime& p = stats.phases[i];
+        // names are identifiers from this library, no escaping needed
+        snprintf(buf, sizeof(buf), "%s\n    {\"name\": \"%s\", \"light\": %d, \"ms\": %.3f}", i ? "," : "",
+            p.name.c_str(), p.light, p.ms);
+        json += buf;
+    }
+    json += stats.phases.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    return json;
+}
+
+bool save_stats(const std::string& filename) {
+    std::ofstream fp(filename);
+    fp << stats_json(stats());
+    return fp.good();
+}
+
+
+}  // namespace Shadowmap
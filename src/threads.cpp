@@ -0,0 +1,138 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#include <algorithm>
+#include "shadowmap.hpp"
+
+
+namespace Shadowmap {
+
+
+ThreadPool::ThreadPool(int threads) : _queues(threads), _locks(threads) {
+    _fn = nullptr;
+    _pending = 0;
+    _active = threads;
+    _generation = 0;
+    _stop = false;
+
+    for (int i = 1; i < threads; i++)
+        _threads.push_back(std::thread(&ThreadPool::_loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (std::thread& t: _threads)
+        t.join();
+}
+
+int ThreadPool::size() const {
+    return _queues.size();
+}
+
+void ThreadPool::run(int count, const std::function<void(int, int)>& fn, int threads) {
+    if (count <= 0)
+        return;
+
+    int n = threads > 0 ? std::min(threads, size()) : size();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _fn = &fn;
+        _pending = count;
+        _active = n;
+    }
+
+    // queues are full before workers wake, so none finds them empty and sleeps
+    for (int i = 0; i < n; i++) {
+        std::lock_guard<std::mutex> lock(_locks[i]);
+        for (int t = (long long)count*i/n; t < (long long)count*(i+1)/n; t++)
+            _queues[i].push_back(t);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _generation++;
+    }
+    _wake.notify_all();
+
+    _work(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this]{return _pending == 0;});
+    _fn = nullptr;
+}
+
+bool ThreadPool::_take(int worker, int& task) {
+    int n = _active;
+    if (worker >= n)
+        return false;
+    for (int i = 0; i < n; i++) {
+        int q = (worker + i) % n;
+        std::lock_guard<std::mutex> lock(_locks[q]);
+        if (_queues[q].empty())
+            continue;
+
+        if (q == worker) {
+            task = _queues[q].front();
+            _queues[q].pop_front();
+        } else {
+            task = _queues[q].back();
+            _queues[q].pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::_work(int worker) {
+    int task;
+    while (_take(worker, task)) {
+        (*_fn)(task, worker);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_pending == 0)
+            _done.notify_all();
+    }
+}
+
+void ThreadPool::_loop(int worker) {
+    int seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [&]{return _stop || _generation != seen;});
+            if (_stop)
+                return;
+            seen = _generation;
+        }
+        _work(worker);
+    }
+}
+
+
+ThreadPool& thread_pool() {
+    // created once, on first use from any thread
+    static ThreadPool pool(std::max((int)std::thread::hardware_concurrency(), 1));
+    return pool;
+}
+
+
+}  // namespace Shadowmap
@@ -18,9 +18,11 @@
 //
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <iostream>
+#include <random>
 #include "shadowmap.hpp"
 
 
@@ -43,7 +45,7 @@ double distance(double dx, double dy) {
     return sqrt(pow(dx, 2) + pow(dy, 2));
 }
 
-double distance(Vec3& v1, Vec3& v2) {
+double distance(const Vec3& v1, const Vec3& v2) {
     return sqrt(pow(v1.x-v2.x, 2) + pow(v1.y-v2.y, 2) + pow(v1.z-v2.z, 2));
 }
 
@@ -60,7 +62,48 @@ bool sign(double v) {
 }
 
 double randd() {
-    return (rand() % (int)1e9) / 1e9;
+    static std::atomic<int> seeds(1);
+    thread_local std::minstd_rand gen(seeds++);
+    return (gen() - gen.min()) / (gen.max() - gen.min() + 1.0);
+}
+
+Rng::Rng(uint64_t seed, uint64_t stream) {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next();
+    state += seed;
+    next();
+}
+
+uint32_t Rng::next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t shifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    return (shifted >> rot) | (shifted << ((-rot) & 31));
+}
+
+double Rng::nextd() {
+    return next() / 4294967296.0;
+}
+
+void sample_2d(uint32_t i, uint32_t scramble_u, uint32_t scramble_v, double& u, double& v) {
+    // first dimension is van der Corput, i.e. i with bits reversed
+    uint32_t a = i;
+    a = (a << 16) | (a >> 16);
+    a = ((a & 0x00ff00ff) << 8) | ((a & 0xff00ff00) >> 8);
+    a = ((a & 0x0f0f0f0f) << 4) | ((a & 0xf0f0f0f0) >> 4);
+    a = ((a & 0x33333333) << 2) | ((a & 0xcccccccc) >> 2);
+    a = ((a & 0x55555555) << 1) | ((a & 0xaaaaaaaa) >> 1);
+
+    uint32_t b = 0;
+    for (uint32_t bit = 1u << 31; i; i >>= 1, bit ^= bit >> 1) {
+        if (i & 1)
+            b ^= bit;
+    }
+
+    u = (a ^ scramble_u) / 4294967296.0;
+    v = (b ^ scramble_v) / 4294967296.0;
 }
 
 int time() {
@@ -80,34 +123,49 @@ double signed_volume(const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& d)
 /**
  * Intersection formula from https://stackoverflow.com/q/42740765/
  */
+bool intersect_face(const Face& f, const Ray& ray, Vec3& pt) {
+    Vec3 q1 = ray.pt.sub(ray.dir.mul(1e4));
+    Vec3 q2 = ray.pt.add(ray.dir.mul(1e4));
+
+    bool a = sign(signed_volume(q1, f.p1, f.p2, f.p3));
+    bool b = sign(signed_volume(q2, f.p1, f.p2, f.p3));
+    bool c = sign(signed_volume(q1, q2, f.p1, f.p2));
+    bool d = sign(signed_volume(q1, q2, f.p2, f.p3));
+    bool e = sign(signed_volume(q1, q2, f.p3, f.p1));
+
+    if ((a != b) && (c == d) && (d == e)) {  // there is intersection
+        Vec3 n = f.p2.sub(f.p1).cross(f.p3.sub(f.p1));
+        double t = -1 * q1.sub(f.p1).dot(n) / q2.sub(q1).dot(n);
+        pt = q1.add(q2.sub(q1).mul(t));
+        return true;
+    }
+    return false;
+}
+
 Intersect intersect(std::vector<Face>& faces, Ray& ray) {
     Intersect ret;
     ret.dist = 1e9;
+    uint64_t culled = 0, tests = 0;
 
     for (Face& f: faces) {
         // ignore face if can't be intersected
         Vec3 delta = f._center.sub(ray.pt);
-        if (ray.dir.angle(delta) > f._angle)
+        if (ray.dir.angle(delta) > f._angle) {
+            culled++;
             continue;
+        }
 
         // if current dist is closer than what this face can possibly be,
         // and all faces later are farther away, then we can stop.
-        if (ret.dist < f._min_dist-0.01)
+        if (ret.dist < f._min_dist-0.01) {
+            _count(STAT_EARLY_EXITS, 1);
             break;
+        }
 
-        Vec3 q1 = ray.pt.sub(ray.dir.mul(1e4));
-        Vec3 q2 = ray.pt.add(ray.dir.mul(1e4));
-
-        bool a = sign(signed_volume(q1, f.p1, f.p2, f.p3));
-        bool b = sign(signed_volume(q2, f.p1, f.p2, f.p3));
-        bool c = sign(signed_volume(q1, q2, f.p1, f.p2));
-        bool d = sign(signed_volume(q1, q2, f.p2, f.p3));
-        bool e = sign(signed_volume(q1, q2, f.p3, f.p1));
+        tests++;
 
-        if ((a != b) && (c == d) && (d == e)) {  // there is intersection
-            Vec3 n = f.p2.sub(f.p1).cross(f.p3.sub(f.p1));
-            double t = -1 * q1.sub(f.p1).dot(n) / q2.sub(q1).dot(n);
-            Vec3 pt = q1.add(q2.sub(q1).mul(t));
+        Vec3 pt;
+        if (intersect_face(f, ray, pt)) {
             double dist = pt.sub(ray.pt).magnitude();
 
             if (dist < ret.dist) {
@@ -119,11 +177,27 @@ Intersect intersect(std::vector<Face>& faces, Ray& ray) {
         }
     }
 
+    _count(STAT_ANGLE_CULLED, culled);
+    _count(STAT_FACE_TESTS, tests);
     return ret;
 }
 
-void build_faces(Scene& scene, Vec3& pt) {
-    for (Face& face: scene._faces) {
+std::vector<Face> build_faces(const Scene& scene, const Vec3& pt) {
+    std::vector<Face> faces;
+    faces.reserve(scene._tris.size());
+    for (int i = 0; i < (int)scene._tris.size(); i++) {
+        if (scene._tri_objs[i] < 0)
+            continue;
+        const Tri& tri = scene._tris[i];
+        Face face(scene._verts[tri.v[0]], scene._verts[tri.v[1]], scene._verts[tri.v[2]], scene._normals[i]);
+        face._color = scene._colors[scene._tri_objs[i]];
+        face._center = face.p1.add(face.p2).add(face.p3).div(3);
+        face._radius = max(
+            distance(face.p1, face._center),
+            distance(face.p2, face._center),
+            distance(face.p3, face._center)
+        );
+
         face._min_dist = min(
             distance(pt, face.p1),
             distance(pt, face.p2),
@@ -136,11 +210,13 @@ void build_faces(Scene& scene, Vec3& pt) {
             center.angle(face.p2.sub(pt)),
             center.angle(face.p3.sub(pt))
         );
+        faces.push_back(face);
     }
 
-    std::sort(scene._faces.begin(), scene._faces.end(),
+    std::sort(faces.begin(), faces.end(),
         [](Face& a, Face& b){return a._min_dist < b._min_dist;}
     );
+    return faces;
 }
 
 
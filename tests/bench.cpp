@@ -0,0 +1,232 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+//
+//  Benchmark on procedural scenes. Everything is generated from a fixed
+//  seed, so runs are comparable across builds.
+//
+//  ./bench.out [scene] [triangles] [lights] [threads]
+//    scene: spheres, soup, plane or all (default)
+//
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "shadowmap.hpp"
+
+using Shadowmap::Mesh;
+using Shadowmap::Rng;
+using Shadowmap::Scene;
+using Shadowmap::Vec3;
+
+
+/**
+ * Milliseconds since start, from Shadowmap::time_ms().
+ */
+double elapsed(double start) {
+    return Shadowmap::time_ms() - start;
+}
+
+/**
+ * Sphere with about 2*rings*rings triangles.
+ */
+void add_sphere(Mesh& mesh, const Vec3& center, double radius, int rings) {
+    auto point = [&](int i, int j) {
+        double tilt = Shadowmap::PI * i / rings, pan = 2 * Shadowmap::PI * j / rings;
+        return Vec3(sin(tilt)*cos(pan), sin(tilt)*sin(pan), cos(tilt));
+    };
+
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < rings; j++) {
+            Vec3 a = point(i, j), b = point(i+1, j), c = point(i+1, j+1), d = point(i, j+1);
+            Vec3 n = a.add(c).unit();
+            mesh.add_face(a.mul(radius).add(center), b.mul(radius).add(center), c.mul(radius).add(center), n);
+            mesh.add_face(a.mul(radius).add(center), c.mul(radius).add(center), d.mul(radius).add(center), n);
+        }
+    }
+}
+
+/**
+ * Square in the z = height plane split into 2*cells*cells triangles.
+ */
+void add_plane(Mesh& mesh, double size, double height, int cells) {
+    double step = size / cells;
+    for (int i = 0; i < cells; i++) {
+        for (int j = 0; j < cells; j++) {
+            double x = -size/2 + i*step, y = -size/2 + j*step;
+            Vec3 a(x, y, height), b(x+step, y, height), c(x+step, y+step, height), d(x, y+step, height);
+            mesh.add_face(a, b, c, Vec3(0, 0, 1));
+            mesh.add_face(a, c, d, Vec3(0, 0, 1));
+        }
+    }
+}
+
+/**
+ * Axis aligned box, 12 triangles.
+ */
+void add_box(Mesh& mesh, const Vec3& lo, const Vec3& hi) {
+    Vec3 c[8];
+    for (int i = 0; i < 8; i++)
+        c[i] = Vec3(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+
+    const int quads[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+    const Vec3 normals[6] = {Vec3(0, 0, -1), Vec3(0, 0, 1), Vec3(0, -1, 0), Vec3(0, 1, 0), Vec3(-1, 0, 0), Vec3(1, 0, 0)};
+    for (int f = 0; f < 6; f++) {
+        const int* q = quads[f];
+        mesh.add_face(c[q[0]], c[q[1]], c[q[2]], normals[f]);
+        mesh.add_face(c[q[0]], c[q[2]], c[q[3]], normals[f]);
+    }
+}
+
+/**
+ * Procedural geometry with about tris triangles, centered on the origin
+ * within about 10 units, above the z = 0 ground.
+ */
+Mesh generate(const std::string& name, int tris) {
+    Mesh mesh;
+    Rng rng(1234, 0);
+
+    if (name == "spheres") {
+        // grid of k*k spheres
+        int k = 4;
+        int rings = std::max((int)sqrt(tris / (2.0*k*k)), 3);
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j < k; j++)
+                add_sphere(mesh, Vec3(i*5 - 7.5, j*5 - 7.5, 2), 1.8, rings);
+        }
+    } else if (name == "soup") {
+        // random small triangles filling a box
+        for (int i = 0; i < tris; i++) {
+            Vec3 p(rng.nextd()*20 - 10, rng.nextd()*20 - 10, rng.nextd()*8 + 0.5);
+            Vec3 e1(rng.nextd() - 0.5, rng.nextd() - 0.5, rng.nextd() - 0.5);
+            Vec3 e2(rng.nextd() - 0.5, rng.nextd() - 0.5, rng.nextd() - 0.5);
+            mesh.add_face(p, p.add(e1), p.add(e2), e1.cross(e2).unit());
+        }
+    } else {
+        // finely divided ground with boxes floating over it
+        int boxes = 64;
+        add_plane(mesh, 24, 0, std::max((int)sqrt((tris - 12.0*boxes) / 2), 1));
+        for (int i = 0; i < boxes; i++) {
+            Vec3 lo(rng.nextd()*18 - 9, rng.nextd()*18 - 9, rng.nextd()*4 + 1);
+            add_box(mesh, lo, lo.add(Vec3(rng.nextd() + 0.5, rng.nextd() + 0.5, rng.nextd() + 0.5)));
+        }
+    }
+
+    mesh.weld();
+    return mesh;
+}
+
+/**
+ * Write mesh as a binary STL file.
+ */
+void write_stl(const Mesh& mesh, const std::string& filename) {
+    std::ofstream fp(filename, std::ios::binary);
+    char header[80] = "shadowmap benchmark";
+    fp.write(header, 80);
+    uint32_t count = mesh.tris.size();
+    fp.write((char*)&count, 4);
+
+    for (size_t i = 0; i < mesh.tris.size(); i++) {
+        float rec[12];
+        const Vec3& n = mesh.normals[i];
+        rec[0] = n.x;  rec[1] = n.y;  rec[2] = n.z;
+        for (int j = 0; j < 3; j++) {
+            const Vec3& p = mesh.verts[mesh.tris[i].v[j]];
+            rec[3 + 3*j] = p.x;  rec[4 + 3*j] = p.y;  rec[5 + 3*j] = p.z;
+        }
+        uint16_t attr = 0;
+        fp.write((char*)rec, sizeof(rec));
+        fp.write((char*)&attr, 2);
+    }
+}
+
+/**
+ * Run all measurements on one scene and print a line of results.
+ */
+void bench(const std::string& name, int tris, int lights, int threads) {
+    std::string path = "/tmp/shadowmap_bench_" + name + ".stl";
+    write_stl(generate(name, tris), path);
+
+    Scene scene(0, -22, 12, 0, 0.45, 70);
+    scene.threads = threads;
+    scene.bg = Vec3(0.05, 0.05, 0.05);
+    scene.SHMAP_W = 1024;
+    scene.SHMAP_H = 512;
+
+    double start = Shadowmap::time_ms();
+    scene.objs.push_back(Mesh(Vec3(0, 0, 0), Vec3(0.8, 0.8, 0.8), path));
+    double load_ms = elapsed(start);
+    remove(path.c_str());
+
+    for (int i = 0; i < lights; i++) {
+        double angle = 2 * Shadowmap::PI * i / lights;
+        scene.add_light(cos(angle)*12, sin(angle)*12, 14, 150.0 / lights, Vec3(1, 1, 1));
+    }
+
+    Shadowmap::reset_stats();
+    start = Shadowmap::time_ms();
+    Shadowmap::build(scene);
+    double build_ms = elapsed(start);
+
+    // thread time of the shadow maps alone, without preprocess and BVH
+    double map_ms = 0;
+    for (const Shadowmap::PhaseTime& phase: Shadowmap::stats().phases) {
+        if (phase.name == "shadow_map")
+            map_ms += phase.ms;
+    }
+
+    // rays from the camera to random points in the scene, single thread
+    const int rays = 200000;
+    Rng rng(99, 0);
+    double hits = 0;
+    start = Shadowmap::time_ms();
+    for (int i = 0; i < rays; i++) {
+        Vec3 target(rng.nextd()*20 - 10, rng.nextd()*20 - 10, rng.nextd()*6);
+        Shadowmap::Ray ray(scene.cam_loc, target.sub(scene.cam_loc));
+        hits += Shadowmap::intersect(scene, ray).dist < 1e9;
+    }
+    double rays_ms = std::max(elapsed(start), 1.0);
+
+    const int samples = 4;
+    Shadowmap::Image img(640, 360);
+    start = Shadowmap::time_ms();
+    Shadowmap::render(scene, img, samples);
+    double render_ms = elapsed(start);
+
+    printf("%-8s %9zu %6d %9.0f %9.0f %9.1f %9.2f %9.1f %8.1f%%\n", name.c_str(), scene._tris.size(), lights,
+        load_ms, build_ms, map_ms / lights, rays / rays_ms / 1000, render_ms / samples,
+        100 * hits / rays);
+}
+
+
+int main(int argc, char** argv) {
+    std::string scene = argc > 1 ? argv[1] : "all";
+    int tris = argc > 2 ? atoi(argv[2]) : 200000;
+    int lights = argc > 3 ? atoi(argv[3]) : 2;
+    int threads = argc > 4 ? atoi(argv[4]) : 0;
+
+    printf("%-8s %9s %6s %9s %9s %9s %9s %9s %9s\n", "scene", "tris", "lights",
+        "load ms", "build ms", "ms/light", "Mrays/s", "ms/spp", "hits");
+    for (const char* name: {"spheres", "soup", "plane"}) {
+        if (scene == "all" || scene == name)
+            bench(name, tris, std::max(lights, 1), threads);
+    }
+}
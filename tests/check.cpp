@@ -0,0 +1,226 @@
+//
+//  Shadowmap
+//  Shadow map rendering engine.
+//  Copyright  Patrick Huang  2022
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+//
+//  Checks of library behaviour that is easy to break and hard to see in
+//  a rendered image. Prints each check and exits with 1 if any fail.
+//
+//  ./check.out
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "shadowmap.hpp"
+
+using Shadowmap::Image;
+using Shadowmap::Mesh;
+using Shadowmap::Scene;
+using Shadowmap::Vec3;
+
+
+/**
+ * Ground plane under one light, seen from above.
+ */
+void ground_scene(Scene& scene) {
+    scene.cam_loc = Vec3(0, -6, 4);
+    scene.cam_tilt = 0.5;
+    scene.SHMAP_W = 256;
+    scene.SHMAP_H = 128;
+    scene.bg = Vec3(0.2, 0.3, 0.4);
+
+    Mesh ground(Vec3(0, 0, 0), Vec3(0.8, 0.8, 0.8));
+    ground.add_face(Vec3(-20, -20, 0), Vec3(20, -20, 0), Vec3(20, 20, 0), Vec3(0, 0, 1));
+    ground.add_face(Vec3(-20, -20, 0), Vec3(20, 20, 0), Vec3(-20, 20, 0), Vec3(0, 0, 1));
+    ground.weld();
+    scene.objs.push_back(ground);
+    scene.add_light(0, 0, 5, 20, Vec3(1, 1, 1));
+}
+
+/**
+ * Every pixel is written by the first pass, however short the time limit.
+ * Renders twice into images filled with different values; a pixel left
+ * unwritten keeps its fill and the two differ.
+ */
+bool check_progressive_deadline() {
+    Scene scene;
+    ground_scene(scene);
+    Shadowmap::build(scene);
+
+    Image a(512, 512), b(512, 512);
+    memset(a.data, 0, 3 * a.w * a.h);
+    memset(b.data, 255, 3 * b.w * b.h);
+    int passes = Shadowmap::render_progressive(scene, a, 1, 100, 1e-9, 0, nullptr);
+    Shadowmap::render_progressive(scene, b, 1, 100, 1e-9, 0, nullptr);
+    return passes == 1 && memcmp(a.data, b.data, 3 * a.w * a.h) == 0;
+}
+
+/**
+ * Trees stay within BVH_MAX_DEPTH, so traversal stacks can't overflow, on
+ * faces growing 32 times each along a line: each binned SAH split peels
+ * only the largest off. Rays still find the faces the forced leaves hold.
+ */
+bool check_deep_tree() {
+    Scene scene;
+    Mesh chain(Vec3(0, 0, 0), Vec3(1, 1, 1));
+    std::vector<double> xs;
+    for (double x = 1e-3; x < 1e300; x *= 32) {
+        chain.add_face(Vec3(x/2, -1, -1), Vec3(x, 1, -1), Vec3(x, 0, 1), Vec3(-1, 0, 0));
+        xs.push_back(x);
+    }
+    chain.weld();
+    scene.objs.push_back(chain);
+    scene.add_light(0, 0, 5, 20, Vec3(1, 1, 1));
+    Shadowmap::build(scene);
+
+    const Shadowmap::Buffer<Shadowmap::BVHNode>& nodes = scene._bvh.nodes;
+    std::vector<std::pair<int, int>> stack = {{0, 0}};  // node, depth
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        if (entry.second > Shadowmap::BVH_MAX_DEPTH)
+            return false;
+        const Shadowmap::BVHNode& node = nodes[entry.first];
+        if (node.count == 0) {
+            stack.push_back({entry.first + 1, entry.second + 1});
+            stack.push_back({node.first, entry.second + 1});
+        }
+    }
+
+    // just in front of each face, where the smaller ones are behind
+    for (double x: xs) {
+        Shadowmap::Intersect hit = Shadowmap::intersect(scene, Shadowmap::Ray(Vec3(0.8*x, 0, 0.2), Vec3(1, 0, 0)));
+        if (hit.dist >= 1e9-10)
+            continue;
+        if (std::abs(hit.dist - 0.1*x) > 1e-6 * x)
+            return false;
+    }
+    return true;
+}
+/**
+ * SHMAP_U16 depths are quantized over [depth_min, depth_max] with
+ * depth_min fitted to the nearest depth, for both builders: within a
+ * step of the exact depths and never nearer.
+ */
+bool check_u16_range() {
+    for (Shadowmap::ShadowBuilder builder: {Shadowmap::SHMAP_RAYTRACE, Shadowmap::SHMAP_RASTER}) {
+        Scene exact, packed;
+        ground_scene(exact);
+        ground_scene(packed);
+        exact.SHMAP_BUILDER = packed.SHMAP_BUILDER = builder;
+        packed.SHMAP_PRECISION = Shadowmap::SHMAP_U16;
+        Shadowmap::build(exact);
+        Shadowmap::build(packed);
+
+        const Shadowmap::ShadowMap& a = exact.shadow_maps[0];
+        const Shadowmap::ShadowMap& b = packed.shadow_maps[0];
+        double step = (b.depth_max - b.depth_min) / 0xfffe, near = 1e9;
+        for (int y = 0; y < a.h; y++) {
+            for (int x = 0; x < a.w; x++) {
+                double d = a.get(x, y), q = b.get(x, y);
+                if (d >= 1e9 ? q < 1e9 : (q < d - 1e-6 || q > d + step))
+                    return false;
+                near = std::min(near, d);
+            }
+        }
+        if (std::abs(b.depth_min - near) > 1e-6)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * load_scene() rejects files with any index out of range, here written
+ * from a built scene with one index broken at a time, and save_scene()
+ * reports files it can't write.
+ */
+bool check_scene_file() {
+    Scene scene;
+    ground_scene(scene);
+    Mesh card(Vec3(0, 0, 0), Vec3(1, 1, 1));
+    card.add_face(Vec3(-1, -1, 0), Vec3(1, -1, 0), Vec3(1, 1, 0), Vec3(0, 0, 1));
+    card.weld();
+    scene.meshes.push_back(card);
+    scene.instances.push_back(Shadowmap::Instance(0, Vec3(0, 0, 1), Vec3(1, 1, 1)));
+    scene.instances.push_back(Shadowmap::Instance(0, Vec3(2, 0, 1), Vec3(1, 1, 1)));
+    Shadowmap::build(scene);
+
+    const char* path = "check_scene.bin";
+    auto loads = [&]() {
+        Scene loaded;
+        return Shadowmap::save_scene(scene, path) && Shadowmap::load_scene(loaded, path);
+    };
+    bool ok = loads();
+
+    int& vert = scene._tris[0].v[1];
+    int& node = scene._bvh.nodes[0].first;
+    int& root = scene._instances[1].root;
+    int& face = scene._mesh_bvh.blocks[0].face[0];
+    for (int* index: {&vert, &node, &root, &face}) {
+        int was = *index;
+        *index = 1 << 20;
+        ok = ok && !loads();
+        *index = was;
+    }
+    ok = ok && loads() && !Shadowmap::save_scene(scene, "no/such/dir/scene.bin");
+    remove(path);
+    return ok;
+}
+
+/**
+ * SHMAP_BUDGET holds even when the maps don't fit at their smallest
+ * budgeted size, 1/16 per side: the least important get smaller still.
+ */
+bool check_budget_overrun() {
+    Scene scene;
+    ground_scene(scene);
+    for (int i = 0; i < 19; i++)
+        scene.add_light(i - 9, 30, 5, 1, Vec3(1, 1, 1));
+    scene.SHMAP_BUDGET = 4096;  // a fifth of 20 maps of 16x8 doubles
+    Shadowmap::build(scene);
+
+    size_t used = 0;
+    for (const Shadowmap::ShadowMap& map: scene.shadow_maps)
+        used += map.bytes();
+    return scene.shadow_maps.size() == 20 && used <= scene.SHMAP_BUDGET
+        && scene.shadow_maps[0].bytes() >= scene.shadow_maps[1].bytes();
+}
+
+
+int main() {
+    std::vector<std::pair<std::string, std::function<bool()>>> checks = {
+        {"progressive deadline", check_progressive_deadline},
+        {"deep tree", check_deep_tree},
+        {"u16 depth range", check_u16_range},
+        {"scene file", check_scene_file},
+        {"budget overrun", check_budget_overrun},
+    };
+
+    int failed = 0;
+    for (auto& check: checks) {
+        bool ok = check.second();
+        printf("%-24s %s\n", check.first.c_str(), ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    return failed > 0;
+}
@@ -33,11 +33,11 @@ int main() {
     scene.add_light(4, -5, 6, 20, Vec3(1, 1, 1));
     scene.add_light(-5, -3, 3, 3.5, Vec3(0.8, 1, 0.8));
 
-    std::ofstream fp("scene1.img");
     Shadowmap::Image img(1280, 720);
+    Shadowmap::ImageWriter writer("scene1.png", img.w, img.h);
 
     Shadowmap::build(scene, true);
-    Shadowmap::render(scene, img, 1, true);
+    Shadowmap::render(scene, img, 1, true, &writer);
 
-    img.write(fp);
+    writer.close();
 }